@@ -1,47 +1,106 @@
 #include <algorithm>
 #include <iostream>
 #include "ae.hpp"
+#include "ae_numa.hpp"
+#include "ae_model.hpp"
 #include <cmath>
 #include <random>
-
-// global var
-VectorXd g_rho;  // for sparse penalty
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <boost/filesystem.hpp>
 
 namespace paracel{
 
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
 // construction function
-autoencoder::autoencoder(paracel::Comm comm, string hosts_dct_str,
-          string _input, string _output, vector<int> _hidden_size,
-          int _visible_size, string method, string _acti_func_type, 
-          int _rounds, double _alpha, bool _debug, int limit_s, 
-          bool ssp_switch, double _lamb, double _sparsity_param, 
-          double _beta, int _mibt_size, int _read_batch, int _update_batch, 
-          bool _corrupt, double _dvt, double _foc) :
-  paracel::paralg(hosts_dct_str, comm, _output, _rounds, limit_s, ssp_switch),
-  input(_input),
-  output(_output),
+autoencoder::autoencoder(paracel::Comm comm, string hosts_dct_str, const ae_options & opt,
+          const vector<unordered_map<string, MatrixXd> > & _WgtBias) :
+  // without servers paralg gets no hosts to connect to and no ssp clock
+  paracel::paralg(opt.servers ? hosts_dct_str : string(), comm, opt.output, opt.rounds, opt.limit_s, opt.servers && opt.ssp_switch),
+  input(opt.input),
+  output(opt.output),
   worker_id(comm.get_rank()),
-  rounds(_rounds),
-  mibt_size(_mibt_size),
-  read_batch(_read_batch),
-  update_batch(_update_batch),
-  learning_method(method),
-  acti_func_type(_acti_func_type),
-  debug(_debug),
-  lamb(_lamb),
-  sparsity_param(_sparsity_param),
-  beta(_beta),
-  alpha(_alpha),
-  hidden_size(_hidden_size),
-  visible_size(_visible_size),
-  corrupt(_corrupt),
-  dvt(_dvt),
-  foc(_foc)  {
+  n_srv(1),
+  rounds(opt.init_model.empty() || opt.warm_rounds <= 0 ? opt.rounds : opt.warm_rounds),
+  mibt_size(opt.mibt_size),
+  read_batch(opt.read_batch),
+  update_batch(opt.update_batch),
+  n_threads(opt.n_threads),
+  sync_interval(opt.sync_interval),
+  learning_method(opt.learning_method),
+  acti_func_type(opt.acti_func_type),
+  debug(opt.debug),
+  byte_shard(opt.byte_shard),
+  rebalance(opt.rebalance),
+  round_budget(opt.round_budget),
+  pin_threads(opt.pin_threads),
+  ar_comm(comm),
+  ar_chunk(opt.ar_chunk),
+  easgd_tau(opt.easgd_tau),
+  easgd_beta(opt.easgd_beta),
+  code_format(opt.code_format),
+  sparse_thld(opt.sparse_thld),
+  lamb(opt.lamb),
+  sparsity_param(opt.sparsity_param),
+  beta(opt.beta),
+  rho_decay(opt.rho_decay),
+  rho_ps(opt.rho_ps),
+  alpha(opt.alpha),
+  alpha0(opt.alpha),
+  lr_schedule(opt.lr_schedule),
+  lr_decay(opt.lr_decay),
+  lr_step(opt.lr_step),
+  lr_min(opt.lr_min),
+  holdout(opt.holdout),
+  patience(opt.patience),
+  min_delta(opt.min_delta),
+  best_hold(0.),
+  last_hold(0.),
+  n_stale(0),
+  hidden_size(opt.hidden_size),
+  visible_size(opt.visible_size),
+  tied(opt.tied),
+  dropout(opt.dropout),
+  key_prefix(opt.key_prefix),
+  init_model(opt.init_model),
+  freeze_layers(opt.freeze_layers),
+  sample_frac(opt.sample_frac),
+  update_lib(opt.update_lib.empty() ? AE_UPDATE_LIB : opt.update_lib),
+  corrupt(opt.corrupt),
+  dvt(opt.dvt),
+  foc(opt.foc)  {
     //hidden_size.assign(_hidden_size.begin(), _hidden_size.end());
     n_lyr = hidden_size.size();  // number of hidden layers
     layer_size.assign(hidden_size.begin(), hidden_size.end());
     layer_size.insert(layer_size.begin(), visible_size);
-    ae_init();
+    rho_est.resize(n_lyr);
+    ws_size = scratch_size(mibt_size);
+    // server_info looks like "host1:7777PARACELhost2:8888"
+    for (size_t pos = opt.servers ? hosts_dct_str.find("PARACEL") : string::npos; pos != string::npos;
+         pos = hosts_dct_str.find("PARACEL", pos + 7)) {
+      n_srv += 1;
+    }
+    vector<int> srv_ids(n_srv);
+    for (int i = 0; i < n_srv; i++) {
+      srv_ids[i] = i;
+    }
+    srv_ring.reset(new paracel::ring<int>(srv_ids));
+    if (!opt.servers && !allreduce_mode()) {
+      std::cerr << learning_method << " exchanges through the paracel servers, it cannot run without them" << std::endl;
+      exit(-1);
+    }
+    if (_WgtBias.empty()) {
+      ae_init();
+    } else {
+      assert((int)_WgtBias.size() == n_lyr);
+      WgtBias = _WgtBias;
+    }
   }
 
 
@@ -61,30 +120,73 @@ void autoencoder::ae_init(){
     VectorXd b1 = VectorXd::Zero(layer_size[i+1]);
     VectorXd b2 = VectorXd::Zero(layer_size[i]);
     InitWgtBias["W1"] = W1;
-    InitWgtBias["W2"] = W2;
+    if (!tied) {
+      InitWgtBias["W2"] = W2;
+    }
     InitWgtBias["b1"] = b1;
     InitWgtBias["b2"] = b2;
 
     WgtBias.push_back(InitWgtBias);
   }
+  // warm start: only layers that were loaded can stay frozen
+  freeze_layers = init_model.empty() ? 0 : std::min(freeze_layers, load_model(init_model));
+}
+
+// The first layers of WgtBias from the files dump_result wrote into dir.
+// Loading stops at the first missing layer or the first one whose shape
+// differs from layer_size; that layer and the ones above it keep their
+// random weights, so a model can be warm started with a layer added on top
+int autoencoder::load_model(const string & dir){
+  int n = 0;
+  for (; n < n_lyr; n++) {
+    string base = todir(dir) + "ae_layer_" + std::to_string(n) + "_";
+    if (!boost::filesystem::exists(base + "W1")) {
+      break;
+    }
+    MatrixXd W1 = load_mat(base + "W1"), W2 = load_mat(base + "W2");
+    MatrixXd b1 = load_mat(base + "b1"), b2 = load_mat(base + "b2");
+    int h = layer_size[n+1], v = layer_size[n];
+    if (W1.rows() != h || W1.cols() != v || W2.rows() != v || W2.cols() != h ||
+        b1.rows() != h || b1.cols() != 1 || b2.rows() != v || b2.cols() != 1) {
+      std::cout << "worker" << get_worker_id() << " layer " << n << " of " << dir
+                << " does not fit " << h << "x" << v << ", it starts from random weights" << std::endl;
+      break;
+    }
+    WgtBias[n]["W1"] = W1;
+    if (!tied) {
+      WgtBias[n]["W2"] = W2;
+    }
+    WgtBias[n]["b1"] = b1;
+    WgtBias[n]["b2"] = b2;
+  }
+  std::cout << "worker" << get_worker_id() << " warm starts " << n << " of " << n_lyr
+            << " layers from " << dir << std::endl;
+  return n;
+}
+
+MatrixXd autoencoder::acti_func(const MatrixXd & non_acti_data) const {
+  MatrixXd acti_data = non_acti_data;
+  acti_apply(acti_data);
+  return acti_data;
 }
 
-inline MatrixXd autoencoder::acti_func(const MatrixXd & non_acti_data) const {
+
+ArrayXXd autoencoder::acti_func_der(const MatrixXd & acti_data) const {
   if (acti_func_type == "sigmoid") {
-    return ( (1.0 / (1 + exp(-non_acti_data.array()))).matrix() ); 
+    return acti_data.array()*(1-acti_data.array());
   }
   else if (acti_func_type == "ReLU") {
-    MatrixXd acti_data(non_acti_data.rows(), non_acti_data.cols());
-    for (int i = 0; i < acti_data.rows(); i++) {
-      for (int j = 0; j < acti_data.cols(); j++) {
-        acti_data(i, j) = max(non_acti_data(i, j), 0.);
+    ArrayXXd der(acti_data.rows(), acti_data.cols());
+    for (int i = 0; i < der.rows(); i++) {
+      for (int j = 0; j < der.cols(); j++) {
+        der(i, j) = (acti_data(i, j) > 0) ? 1: 0;
       }
     }
-    return acti_data;
+    return der;
   }
   else if (acti_func_type == "tanh") { 
-    Eigen::ArrayXXd tmp = non_acti_data.array();
-    return ( ((exp(tmp) - exp(-tmp)) / (exp(tmp) + exp(-tmp))).matrix() );
+    std::cout << "Not applicable by far" << std::endl;
+    exit(-1);
   }
   else{
     std::cerr << "The activation function is not implemented by far." << std::endl;
@@ -93,18 +195,30 @@ inline MatrixXd autoencoder::acti_func(const MatrixXd & non_acti_data) const {
 }
 
 
-inline ArrayXXd autoencoder::acti_func_der(const MatrixXd & acti_data) const {
+void autoencoder::acti_apply(Eigen::Ref<MatrixXd> z) const {
   if (acti_func_type == "sigmoid") {
-    return acti_data.array()*(1-acti_data.array());
+    z.array() = 1.0 / (1 + (-z.array()).exp());
   }
   else if (acti_func_type == "ReLU") {
-    ArrayXXd der(acti_data.rows(), acti_data.cols());
-    for (int i = 0; i < der.rows(); i++) {
-      for (int j = 0; j < der.cols(); j++) {
-        der(i, j) = (acti_data(i, j) > 0) ? 1: 0;
-      }
-    }
-    return der;
+    z.array() = z.array().max(0.);
+  }
+  else if (acti_func_type == "tanh") { 
+    z.array() = z.array().tanh();
+  }
+  else{
+    std::cerr << "The activation function is not implemented by far." << std::endl;
+    exit(-1);
+  }
+}
+
+
+// s *= f'(a) with a = f(z)
+void autoencoder::acti_der_mul(Eigen::Ref<MatrixXd> s, const Eigen::Ref<const MatrixXd> & a) const {
+  if (acti_func_type == "sigmoid") {
+    s.array() *= a.array() * (1 - a.array());
+  }
+  else if (acti_func_type == "ReLU") {
+    s.array() *= (a.array() > 0).cast<double>();
   }
   else if (acti_func_type == "tanh") { 
     std::cout << "Not applicable by far" << std::endl;
@@ -122,51 +236,84 @@ vector<unordered_map<string, MatrixXd> > autoencoder::GetWgtBias() const{
  }
 
 
+// one workspace per thread, so the hogwild threads never share one; it is
+// reserved on first use and only grows for a larger network
+workspace & autoencoder::scratch() const {
+  static thread_local workspace ws;
+  ws.reserve(ws_size);
+  return ws;
+}
+
+// doubles of workspace for mini-batches of b samples: activations and
+// errors, the hidden activations of the batch and the rank-k buffers of
+// the weight gradients
+size_t autoencoder::scratch_size(int b) const {
+  size_t sz = 0;
+  size_t k = std::max(b, 32);
+  for (int i = 0; i < n_lyr; i++) {
+    size_t h = layer_size[i+1], v = layer_size[i];
+    sz = std::max(sz, h * std::max(b, 1) + 2 * (h + v) * k + 9 * (h + v) + 64);
+  }
+  return sz;
+}
+
+// a2 = f(W1 x_i + b1)
+void autoencoder::encode(int lyr, int i, Eigen::Ref<VectorXd> a2) const {
+  sample_prod(a2, WgtBias[lyr].at("W1"), i);
+  a2 += WgtBias[lyr].at("b1");
+  acti_apply(a2);
+}
+
+// a3 = f(W2 a2 + b2)
+void autoencoder::decode(int lyr, const Eigen::Ref<const VectorXd> & a2, Eigen::Ref<VectorXd> a3) const {
+  dec_prod(lyr, a2, a3);
+  a3 += WgtBias[lyr].at("b2");
+  acti_apply(a3);
+}
+
+// errors of sample i, s3 = (a3 - x_i) f'(a3) and s2 = (W2^T s3 + ksig) f'(a2);
+// ksig is the sparse penalty term and left empty without one
+void autoencoder::backprop(int lyr, int i, const Eigen::Ref<const VectorXd> & a2,
+                           const Eigen::Ref<const VectorXd> & a3, const Eigen::Ref<const VectorXd> & ksig,
+                           Eigen::Ref<VectorXd> s3, Eigen::Ref<VectorXd> s2) const {
+  s3 = a3;
+  sample_sub(s3, i);
+  acti_der_mul(s3, a3);
+  dec_tprod(lyr, s3, s2);
+  if (ksig.size()) {
+    s2 += ksig;
+  }
+  acti_der_mul(s2, a2);
+}
+
+
 // compute the cost of a single layer of NN
 double autoencoder::ae_cost(int lyr) const {
-  int i;
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t a2 = ws.vec(layer_size[lyr+1]);
+  workspace::vec_t a3 = ws.vec(layer_size[lyr]);
+  workspace::vec_t rho = ws.vec(layer_size[lyr+1]);
   double cost = 0;
-  VectorXd sparse_kl;  // sparse penalty
-  const MatrixXd & W1 = WgtBias[lyr].at("W1");
-  const MatrixXd & W2 = WgtBias[lyr].at("W2");
-  const VectorXd & b1 = WgtBias[lyr].at("b1");
-  const VectorXd & b2 = WgtBias[lyr].at("b2");
-  unordered_map<int, VectorXd> a;
-  unordered_map<int, VectorXd> z;
-  if (beta != 0 && learning_method == "dbgd") {
-    g_rho = VectorXd::Zero(b1.rows(), b1.cols());
-    // traverse network
-    for (i = 0; i < data.cols(); i++) {
-      a[1] = data.col(i);
-      z[2] = W1 * a[1] + b1;
-      a[2] = acti_func(z[2]);
-      z[3] = W2 * a[2] + b2;
-      a[3] = acti_func(z[3]);
-      cost += ((a[1]-a[3]).array().pow(2)/2).sum();
-      g_rho += a[2];
-    }
-    // rho post-process
-    g_rho = (g_rho.array() / data.cols()).matrix();
-
-    // cost post-process
-    sparse_kl = sparsity_param * log(sparsity_param/g_rho.array()) +\
-                (1-sparsity_param) * log((1-sparsity_param)/(1-g_rho.array()));
-    cost /= data.cols();
-    cost += lamb/2. * (W1.array().pow(2).sum() + W2.array().pow(2).sum()) +\
-            beta*sparse_kl.sum();
-  }else{ // without sparse term
-    // traverse network
-    for (i = 0; i < data.cols(); i++) {
-      a[1] = data.col(i);
-      z[2] = W1 * a[1] + b1;
-      a[2] = acti_func(z[2]);
-      z[3] = W2 * a[2] + b2;
-      a[3] = acti_func(z[3]);
-      cost += ((a[1]-a[3]).array().pow(2)/2).sum();
-    }
-    // cost post-process
-    cost /= data.cols();
-    cost += lamb/2. * (W1.array().pow(2).sum() + W2.array().pow(2).sum());
+  rho.setZero();
+  // traverse network
+  for (int i = 0; i < n_samples(); i++) {
+    encode(lyr, i, a2);
+    decode(lyr, a2, a3);
+    sample_sub(a3, i);
+    cost += a3.squaredNorm() / 2;
+    if (beta != 0) {
+      rho += a2;
+    }
+  }
+  // cost post-process
+  cost /= n_samples();
+  cost += lamb/2. * wgt_sqnorm(lyr);
+  if (beta != 0) {
+    // sparse penalty
+    rho /= n_samples();
+    cost += beta * (sparsity_param * log(sparsity_param/rho.array()) +\
+                    (1-sparsity_param) * log((1-sparsity_param)/(1-rho.array()))).sum();
   }
   return cost;
 }
@@ -175,139 +322,502 @@ double autoencoder::ae_cost(int lyr) const {
 // compute batch gradient
 unordered_map<string, MatrixXd> autoencoder::ae_batch_grad(int lyr) const{
   const MatrixXd & W1 = WgtBias[lyr].at("W1");
-  const MatrixXd & W2 = WgtBias[lyr].at("W2");
-  const VectorXd & b1 = WgtBias[lyr].at("b1");
-  const VectorXd & b2 = WgtBias[lyr].at("b2");
-
-  MatrixXd W1_delta = MatrixXd::Zero(W1.rows(), W1.cols());
-  MatrixXd W2_delta = MatrixXd::Zero(W2.rows(), W2.cols());
-  VectorXd b1_delta = VectorXd::Zero(b1.size());
-  VectorXd b2_delta = VectorXd::Zero(b2.size());
-
-  // Use ArrayXd may be better! Take into consideration.
-  unordered_map<int, VectorXd> a;
-  unordered_map<int, VectorXd> z;
-  unordered_map<int, VectorXd> sigma;
-  for (int i = 0; i < data.cols(); i++) {
-    a[1] = data.col(i);
-    z[2] = W1 * a[1] + b1;
-    a[2] = acti_func(z[2]);
-    z[3] = W2 * a[2] + b2;
-    a[3] = acti_func(z[3]);
-    sigma[3] = (-(a[1]-a[3]).array() * (acti_func_der(a[3]))).matrix();
-    VectorXd sparsity_sigma = -sparsity_param/g_rho.array() +\
-                          (1-sparsity_param)*(1-g_rho.array());
-    sigma[2] = (((W2.transpose()*sigma[3]).array() + beta*sparsity_sigma.array())*\
-                acti_func_der(a[2])).matrix();
-
-    W1_delta += sigma[2] * a[1].transpose();
-    W2_delta += sigma[3] * a[2].transpose();
-    b1_delta += sigma[2];
-    b2_delta += sigma[3];
-  }
+  int h = layer_size[lyr+1], v = layer_size[lyr];
 
-  // return the gradients
   unordered_map<string, MatrixXd> WgtBiasGrad;
-  WgtBiasGrad["W1"] = (W1_delta.array() / data.cols() + lamb * W1.array()).matrix();
-  WgtBiasGrad["W2"] = (W2_delta.array() / data.cols() + lamb * W2.array()).matrix();
-  WgtBiasGrad["b1"] = (b1_delta.array() / data.cols()).matrix();
-  WgtBiasGrad["b2"] = (b2_delta.array() / data.cols()).matrix();
+  MatrixXd & W1_delta = WgtBiasGrad["W1"] = MatrixXd::Zero(h, v);
+  MatrixXd none;
+  MatrixXd & W2_delta = tied ? none : (WgtBiasGrad["W2"] = MatrixXd::Zero(v, h));
+  MatrixXd & b1_delta = WgtBiasGrad["b1"] = MatrixXd::Zero(h, 1);
+  MatrixXd & b2_delta = WgtBiasGrad["b2"] = MatrixXd::Zero(v, 1);
+
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t a2 = ws.vec(h), a3 = ws.vec(v);
+  workspace::vec_t s2 = ws.vec(h), s3 = ws.vec(v);
+  // exact rho over the local data, batch gradient can afford the extra pass
+  workspace::vec_t sparsity_sigma = ws.vec(beta != 0 ? h : 0);
+  if (beta != 0) {
+    workspace::vec_t rho = ws.vec(h);
+    rho.setZero();
+    for (int i = 0; i < n_samples(); i++) {
+      encode(lyr, i, a2);
+      rho += a2;
+    }
+    rho /= n_samples();
+    kl_sigma(rho, sparsity_sigma);
+  }
+  // weight gradients are accumulated as rank-k updates
+  outer_acc W1_acc(W1_delta, ws, 32), W2_acc(W2_delta, ws, 32);
+  for (int i = 0; i < n_samples(); i++) {
+    encode(lyr, i, a2);
+    decode(lyr, a2, a3);
+    backprop(lyr, i, a2, a3, sparsity_sigma, s3, s2);
+
+    sample_outer(W1_acc, s2, i);
+    dec_outer(W1_acc, W2_acc, s3, a2);
+    b1_delta += s2;
+    b2_delta += s3;
+  }
+  W1_acc.flush();
+  W2_acc.flush();
 
+  // return the gradients
+  W1_delta = W1_delta / n_samples() + w1_lamb() * W1;
+  if (!tied) {
+    W2_delta = W2_delta / n_samples() + lamb * WgtBias[lyr].at("W2");
+  }
+  b1_delta /= n_samples();
+  b2_delta /= n_samples();
   return WgtBiasGrad;
 }
 
 
-// compute the stochastic gradient
-unordered_map<string, MatrixXd> autoencoder::ae_stoc_grad(int lyr, int index) const {
-  unordered_map<string, MatrixXd> WgtBiasGrad;
-  const MatrixXd & W1 = WgtBias[lyr].at("W1");
-  const MatrixXd & W2 = WgtBias[lyr].at("W2");
-  const VectorXd & b1 = WgtBias[lyr].at("b1");
-  const VectorXd & b2 = WgtBias[lyr].at("b2");
-  
-  // means no mini-batch
-  unordered_map<int, VectorXd> a;
-  unordered_map<int, VectorXd> z;
-  unordered_map<int, VectorXd> sigma;
-  a[1] = data.col(index);
-  z[2] = W1 * a[1] + b1;
-  a[2] = acti_func(z[2]);
-  z[3] = W2 * a[2] + b2;
-  a[3] = acti_func(z[3]);
-  sigma[3] = (-(a[1]-a[3]).array() * (acti_func_der(a[3]))).matrix();
-  sigma[2] = (((W2.transpose()*sigma[3]).array())*acti_func_der(a[2])).matrix();
-  //sigma[3] = (-(a[1]-a[3]).array() * (a[3].array()*(1-a[3].array()))).matrix();
-  //sigma[2] = (((W2.transpose()*sigma[3]).array())*a[2].array()*(1-a[2].array())).matrix();
-  // gradient of that sample
-  WgtBiasGrad["W1"] = sigma[2] * a[1].transpose();  
-  WgtBiasGrad["W2"] = sigma[3] * a[2].transpose();  
-  WgtBiasGrad["W1"] = (WgtBiasGrad.at("W1").array() + lamb * W1.array()).matrix();  
-  WgtBiasGrad["W2"] = (WgtBiasGrad.at("W2").array() + lamb * W2.array()).matrix();  
-  WgtBiasGrad["b1"] = sigma[2];  
-  WgtBiasGrad["b2"] = sigma[3];  
+// grad[key] = 0 in the shape of WgtBias[lyr][key]; reuses the storage of
+// the previous call
+static void grad_zero(unordered_map<string, MatrixXd> & grad, const unordered_map<string, MatrixXd> & wb) {
+  for (auto & kv : wb) {
+    grad[kv.first].setZero(kv.second.rows(), kv.second.cols());
+  }
+}
 
-  return WgtBiasGrad;
+
+// compute the stochastic gradient
+void autoencoder::ae_stoc_grad(int lyr, int index, unordered_map<string, MatrixXd> & grad) {
+  int h = layer_size[lyr+1], v = layer_size[lyr];
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t a2 = ws.vec(h);
+  workspace::vec_t sparsity_sigma = ws.vec(beta != 0 ? h : 0);
+  grad_zero(grad, WgtBias[lyr]);
+
+  if (dropout > 0) {
+    static thread_local vector<int> kept;
+    drop_forward(lyr, index, kept, a2);
+    if (beta != 0) {
+      rho_update(lyr, a2);
+      kl_sigma(rho_est[lyr], sparsity_sigma);
+    }
+    drop_backward(lyr, index, kept, a2, sparsity_sigma, grad["W1"],
+                  tied ? grad["W1"] : grad["W2"],
+                  grad["b1"].col(0), grad["b2"].col(0));
+  } else {
+    // means no mini-batch
+    workspace::vec_t a3 = ws.vec(v);
+    encode(lyr, index, a2);
+    decode(lyr, a2, a3);
+    if (beta != 0) {
+      rho_update(lyr, a2);
+      kl_sigma(rho_est[lyr], sparsity_sigma);
+    }
+    workspace::vec_t s3 = ws.vec(v), s2 = ws.vec(h);
+    backprop(lyr, index, a2, a3, sparsity_sigma, s3, s2);
+    // gradient of that sample
+    sample_outer(grad["W1"], s2, index);
+    if (tied) {
+      grad["W1"].noalias() += a2 * s3.transpose();
+    } else {
+      grad["W2"].noalias() += s3 * a2.transpose();
+    }
+    grad["b1"] = s2;
+    grad["b2"] = s3;
+  }
+  grad["W1"] += w1_lamb() * WgtBias[lyr].at("W1");
+  if (!tied) {
+    grad["W2"] += lamb * WgtBias[lyr].at("W2");
+  }
 }
 
 
 // compute the mini-batch stochastic gradient
-unordered_map<string, MatrixXd> autoencoder::ae_mibt_stoc_grad(int lyr, vector<int> index_data) const {
+void autoencoder::ae_mibt_stoc_grad(int lyr, const vector<int> & index_data,
+                                    unordered_map<string, MatrixXd> & grad) {
 
   size_t mini_batch_size = index_data.size();
-  unordered_map<string, MatrixXd> WgtBiasGrad;
-  const MatrixXd & W1 = WgtBias[lyr].at("W1");
-  const MatrixXd & W2 = WgtBias[lyr].at("W2");
-  const VectorXd & b1 = WgtBias[lyr].at("b1");
-  const VectorXd & b2 = WgtBias[lyr].at("b2");
-  
   if (!(mini_batch_size-1)) {
     // means no mini-batch
-    WgtBiasGrad = ae_stoc_grad(lyr, index_data[0]);
-
-  }else{
-    // Got a mini-batch SGD
-    MatrixXd W1_delta = MatrixXd::Zero(W1.rows(), W1.cols());
-    MatrixXd W2_delta = MatrixXd::Zero(W2.rows(), W2.cols());
-    VectorXd b1_delta = VectorXd::Zero(b1.size());
-    VectorXd b2_delta = VectorXd::Zero(b2.size());
-    unordered_map<int, VectorXd> a;
-    unordered_map<int, VectorXd> z;
-    unordered_map<int, VectorXd> sigma;
-    /*
-    // Get rho first
-    VectorXd rho = VectorXd::Zero(b1.size());
-    for (auto i : index_data) {
-      a[1] = data.col(i);
-      z[2] = W1 * a[1] + b1;
-      a[2] = acti_func(z[2]);
-      rho += a[2];
-    }
-    rho = (rho.array() / mini_batch_size).matrix();
-    */
-    // BP
-    for (auto i: index_data) {
-      a[1] = data.col(i);
-      z[2] = W1 * a[1] + b1;
-      a[2] = acti_func(z[2]);
-      z[3] = W2 * a[2] + b2;
-      a[3] = acti_func(z[3]);
-      sigma[3] = (-(a[1]-a[3]).array() * (acti_func_der(a[3]))).matrix();
-      sigma[2] = (((W2.transpose()*sigma[3]).array())*acti_func_der(a[2])).matrix();
-
-      W1_delta += sigma[2] * a[1].transpose();
-      W2_delta += sigma[3] * a[2].transpose();
-      b1_delta += sigma[2];
-      b2_delta += sigma[3];
-    }
-    WgtBiasGrad["W1"] = (W1_delta.array() / mini_batch_size + lamb * W1.array()).matrix();
-    WgtBiasGrad["W2"] = (W2_delta.array() / mini_batch_size + lamb * W2.array()).matrix();
-    WgtBiasGrad["b1"] = (b1_delta.array() / mini_batch_size).matrix();
-    WgtBiasGrad["b2"] = (b2_delta.array() / mini_batch_size).matrix();
-
-  }  // else ends
-  return WgtBiasGrad;
+    ae_stoc_grad(lyr, index_data[0], grad);
+    return;
+  }
+
+  // Got a mini-batch SGD
+  int h = layer_size[lyr+1], v = layer_size[lyr];
+  grad_zero(grad, WgtBias[lyr]);
+  MatrixXd & W1_delta = grad["W1"];
+  MatrixXd & W2_delta = tied ? W1_delta : grad["W2"];
+  MatrixXd & b1_delta = grad["b1"];
+  MatrixXd & b2_delta = grad["b2"];
+
+  workspace & ws = scratch();
+  if ((int)mini_batch_size > mibt_size) {
+    ws.reserve(scratch_size(mini_batch_size));
+  }
+  workspace::frame fr(ws);
+  // hidden activations first, their batch mean feeds the running rho
+  workspace::mat_t a2_mibt = ws.mat(h, mini_batch_size);
+  static thread_local vector<vector<int> > kept;
+  if (dropout > 0 && kept.size() < mini_batch_size) {
+    kept.resize(mini_batch_size);
+  }
+  for (size_t k = 0; k < mini_batch_size; k++) {
+    if (dropout > 0) {
+      drop_forward(lyr, index_data[k], kept[k], a2_mibt.col(k));
+    } else {
+      encode(lyr, index_data[k], a2_mibt.col(k));
+    }
+  }
+  workspace::vec_t sparsity_sigma = ws.vec(beta != 0 ? h : 0);
+  if (beta != 0) {
+    workspace::vec_t rho = ws.vec(h);
+    rho = a2_mibt.rowwise().sum() / mini_batch_size;
+    rho_update(lyr, rho);
+    kl_sigma(rho_est[lyr], sparsity_sigma);
+  }
+  // BP
+  workspace::vec_t a3 = ws.vec(v), s3 = ws.vec(v), s2 = ws.vec(h);
+  outer_acc W1_acc(W1_delta, ws, mini_batch_size), W2_acc(W2_delta, ws, tied ? 0 : mini_batch_size);
+  for (size_t k = 0; k < mini_batch_size; k++) {
+    if (dropout > 0) {
+      drop_backward(lyr, index_data[k], kept[k], a2_mibt.col(k), sparsity_sigma,
+                    W1_delta, W2_delta, b1_delta.col(0), b2_delta.col(0));
+      continue;
+    }
+    int i = index_data[k];
+    decode(lyr, a2_mibt.col(k), a3);
+    backprop(lyr, i, a2_mibt.col(k), a3, sparsity_sigma, s3, s2);
+
+    sample_outer(W1_acc, s2, i);
+    dec_outer(W1_acc, W2_acc, s3, a2_mibt.col(k));
+    b1_delta += s2;
+    b2_delta += s3;
+  }
+  W1_acc.flush();
+  W2_acc.flush();
+  W1_delta = W1_delta / mini_batch_size + w1_lamb() * WgtBias[lyr].at("W1");
+  if (!tied) {
+    W2_delta = W2_delta / mini_batch_size + lamb * WgtBias[lyr].at("W2");
+  }
+  b1_delta /= mini_batch_size;
+  b2_delta /= mini_batch_size;
+}
+
+// apply the stochastic gradient of one sample straight into WgtBias[lyr]
+// and mirror it into the running delta; called concurrently by the
+// hogwild threads without any locking. Each thread keeps its own rho,
+// the caller merges them. Weight decay is left to the caller, see
+// hogwild_decay
+void autoencoder::ae_stoc_update(int lyr, int index, double step,
+                                 unordered_map<string, MatrixXd> & delta,
+                                 MatrixXd & rho) {
+  MatrixXd & W1 = WgtBias[lyr].at("W1");
+  MatrixXd & b1 = WgtBias[lyr].at("b1");
+  MatrixXd & b2 = WgtBias[lyr].at("b2");
+  MatrixXd & W1_delta = delta.at("W1");
+  int h = layer_size[lyr+1], v = layer_size[lyr];
+
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t a2 = ws.vec(h), a3 = ws.vec(v);
+  workspace::vec_t s2 = ws.vec(h), s3 = ws.vec(v);
+  workspace::vec_t sparsity_sigma = ws.vec(beta != 0 ? h : 0);
+  encode(lyr, index, a2);
+  decode(lyr, a2, a3);
+  if (beta != 0) {
+    rho_update(rho, a2);
+    kl_sigma(rho, sparsity_sigma);
+  }
+  backprop(lyr, index, a2, a3, sparsity_sigma, s3, s2);
+
+  // zero spectrum bins do not touch their column of W1
+  if (sparse_input) {
+    sample_outer(W1, s2, index, -step);
+    sample_outer(W1_delta, s2, index, -step);
+  } else {
+    Eigen::Map<const VectorXd> xi = sample_col(index, ws);
+    for (int j = 0; j < v; j++) {
+      double x = xi(j);
+      if (x != 0) {
+        W1.col(j) -= (step * x) * s2;
+        W1_delta.col(j) -= (step * x) * s2;
+      }
+    }
+  }
+  if (tied) {
+    W1.noalias() -= step * a2 * s3.transpose();
+    W1_delta.noalias() -= step * a2 * s3.transpose();
+  } else {
+    WgtBias[lyr].at("W2").noalias() -= step * s3 * a2.transpose();
+    delta.at("W2").noalias() -= step * s3 * a2.transpose();
+  }
+  b1 -= step * s2;
+  b2 -= step * s3;
+  delta.at("b1") -= step * s2;
+  delta.at("b2") -= step * s3;
+}
+
+
+// W -= alpha * grad, accumulating the applied step into delta so the
+// trainers never need a snapshot of the weights to form what they push
+void autoencoder::apply_step(int lyr, unordered_map<string, MatrixXd> & grad,
+                             unordered_map<string, MatrixXd> & delta) {
+  for (auto & kv : grad) {
+    kv.second *= -alpha;
+    WgtBias[lyr].at(kv.first) += kv.second;
+    delta.at(kv.first) += kv.second;
+  }
+}
+
+
+void autoencoder::zero_delta(unordered_map<string, MatrixXd> & delta) const {
+  for (auto & kv : delta) {
+    kv.second.setZero();
+  }
+}
+
+// decoder product W2 * x; a tied layer applies W1^T as a transposed view
+// instead of materializing it
+void autoencoder::dec_prod(int lyr, const Eigen::Ref<const VectorXd> & x, Eigen::Ref<VectorXd> out) const {
+  if (tied) {
+    out.noalias() = WgtBias[lyr].at("W1").transpose() * x;
+  } else {
+    out.noalias() = WgtBias[lyr].at("W2") * x;
+  }
+}
+
+// W2^T * s
+void autoencoder::dec_tprod(int lyr, const Eigen::Ref<const VectorXd> & s, Eigen::Ref<VectorXd> out) const {
+  if (tied) {
+    out.noalias() = WgtBias[lyr].at("W1") * s;
+  } else {
+    out.noalias() = WgtBias[lyr].at("W2").transpose() * s;
+  }
 }
 
+// decoder part of the weight gradient, s3 * a2^T; folded into W1 as its
+// transpose when tied
+void autoencoder::dec_outer(outer_acc & W1_acc, outer_acc & W2_acc,
+                            const Eigen::Ref<const VectorXd> & s3, const Eigen::Ref<const VectorXd> & a2) const {
+  if (tied) {
+    W1_acc.add(a2, s3);
+  } else {
+    W2_acc.add(s3, a2);
+  }
+}
+
+// |W1|^2 + |W2|^2
+double autoencoder::wgt_sqnorm(int lyr) const {
+  double sq = WgtBias[lyr].at("W1").squaredNorm();
+  return tied ? 2 * sq : sq + WgtBias[lyr].at("W2").squaredNorm();
+}
+
+// weight decay seen by W1, which also stands in for W2 when tied
+double autoencoder::w1_lamb() const {
+  return tied ? 2 * lamb : lamb;
+}
+
+
+// xorshift128+ stream of the calling thread
+static uint64_t drop_rand() {
+  static thread_local uint64_t s[2] = {0, 0};
+  if (s[0] == 0 && s[1] == 0) {
+    std::random_device rd;
+    s[0] = (uint64_t(rd()) << 32) | rd();
+    s[1] = (uint64_t(rd()) << 32) | rd() | 1;
+  }
+  uint64_t x = s[0];
+  const uint64_t y = s[1];
+  s[0] = y;
+  x ^= x << 23;
+  s[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+  return s[1] + y;
+}
+
+// keep probability of a unit quantized to 16 bits
+static unsigned drop_keep_bits(double dropout) {
+  long t = std::lround((1. - dropout) * 65536);
+  return (unsigned)std::min(std::max(t, 1L), 65535L);
+}
+
+// keep mask of n units, 64 per word. Every bit is set with probability
+// T / 2^16 by folding random words from the lowest set bit of T upwards,
+// OR for a one bit and AND for a zero bit, so a word of 64 units costs at
+// most 16 draws and a single one for dropout = 0.5
+void autoencoder::drop_mask(int n, uint64_t * mask) const {
+  unsigned t = drop_keep_bits(dropout);
+  int lo = __builtin_ctz(t);
+  for (int w = 0; w < drop_words(n); w++) {
+    uint64_t m = drop_rand();
+    for (int b = lo + 1; b < 16; b++) {
+      m = ((t >> b) & 1) ? (m | drop_rand()) : (m & drop_rand());
+    }
+    mask[w] = m;
+  }
+  if (n % 64) {
+    mask[drop_words(n) - 1] &= (uint64_t(1) << (n % 64)) - 1;
+  }
+}
+
+// fused mask and activation of one column: draws the mask, evaluates the
+// activation on the kept units only and leaves f(z) / keep there, 0 on the
+// dropped ones. kept lists the surviving units in increasing order
+void autoencoder::drop_acti(Eigen::Ref<VectorXd> z, uint64_t * mask, vector<int> & kept) const {
+  int n = z.size();
+  drop_mask(n, mask);
+  kept.clear();
+  for (int w = 0; w < drop_words(n); w++) {
+    for (uint64_t m = mask[w]; m; m &= m - 1) {
+      kept.push_back(64 * w + __builtin_ctzll(m));
+    }
+  }
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t zk = ws.vec(kept.size());
+  for (size_t t = 0; t < kept.size(); t++) {
+    zk(t) = z(kept[t]);
+  }
+  acti_apply(zk);
+  zk /= drop_keep();
+  z.setZero();
+  for (size_t t = 0; t < kept.size(); t++) {
+    z(kept[t]) = zk(t);
+  }
+}
+
+double autoencoder::drop_keep() const {
+  return drop_keep_bits(dropout) / 65536.;
+}
+
+// v *= mask / keep
+void autoencoder::drop_apply(Eigen::Ref<VectorXd> v, const uint64_t * mask) const {
+  double inv_keep = 1. / drop_keep();
+  for (int r = 0; r < v.size(); r++) {
+    v(r) = ((mask[r / 64] >> (r % 64)) & 1) ? v(r) * inv_keep : 0.;
+  }
+}
+
+// hidden layer of sample i under dropout, h = f(W1 x_i + b1) / keep on kept
+void autoencoder::drop_forward(int lyr, int i, vector<int> & kept, Eigen::Ref<VectorXd> h) const {
+  static thread_local vector<uint64_t> mask;
+  mask.resize(drop_words(h.size()));
+  sample_prod(h, WgtBias[lyr].at("W1"), i);
+  h += WgtBias[lyr].at("b1");
+  drop_acti(h, mask.data(), kept);
+}
+
+// accumulate the gradient of sample i given its dropped-out hidden layer.
+// The decoder reads and the weight gradients touch only the kept units,
+// dropped units have zero activation and zero error
+void autoencoder::drop_backward(int lyr, int i, const vector<int> & kept,
+                                const Eigen::Ref<const VectorXd> & h,
+                                const Eigen::Ref<const VectorXd> & sparsity_sigma,
+                                Eigen::Ref<MatrixXd> W1_delta, Eigen::Ref<MatrixXd> W2_delta,
+                                Eigen::Ref<VectorXd> b1_delta, Eigen::Ref<VectorXd> b2_delta) const {
+  const MatrixXd & W1 = WgtBias[lyr].at("W1");
+  const MatrixXd & W2 = tied ? W1 : WgtBias[lyr].at("W2");
+  int k = kept.size();
+  double keep = drop_keep();
+
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t z3 = ws.vec(layer_size[lyr]), sigma3 = ws.vec(layer_size[lyr]);
+  workspace::vec_t hk = ws.vec(k), sigma2 = ws.vec(k);
+  z3 = WgtBias[lyr].at("b2");
+  for (int t = 0; t < k; t++) {
+    if (tied) {
+      z3.noalias() += h(kept[t]) * W1.row(kept[t]).transpose();
+    } else {
+      z3.noalias() += h(kept[t]) * W2.col(kept[t]);
+    }
+  }
+  acti_apply(z3);
+  sigma3 = z3;
+  sample_sub(sigma3, i);
+  acti_der_mul(sigma3, z3);
+
+  for (int t = 0; t < k; t++) {
+    int j = kept[t];
+    hk(t) = h(j) * keep;
+    sigma2(t) = tied ? W1.row(j).dot(sigma3) : W2.col(j).dot(sigma3);
+    if (sparsity_sigma.size()) {
+      sigma2(t) += sparsity_sigma(j);
+    }
+  }
+  sigma2 /= keep;
+  acti_der_mul(sigma2, hk);
+
+  drop_outer(W1_delta, kept, sigma2, i);
+  for (int t = 0; t < k; t++) {
+    int j = kept[t];
+    if (tied) {
+      W1_delta.row(j).noalias() += h(j) * sigma3.transpose();
+    } else {
+      W2_delta.col(j).noalias() += h(j) * sigma3;
+    }
+    b1_delta(j) += sigma2(t);
+  }
+  b2_delta += sigma3;
+}
+
+// G.row(kept[t]) += s(t) * x_i^T, skipping the dropped rows
+void autoencoder::drop_outer(Eigen::Ref<MatrixXd> G, const vector<int> & kept,
+                             const Eigen::Ref<const VectorXd> & s, int i) const {
+  if (sparse_input) {
+    for (Eigen::SparseMatrix<double>::InnerIterator it(*in_sdata, i); it; ++it) {
+      double * g = G.col(it.index()).data();
+      for (size_t t = 0; t < kept.size(); t++) {
+        g[kept[t]] += it.value() * s(t);
+      }
+    }
+  } else {
+    workspace & ws = scratch();
+    workspace::frame fr(ws);
+    Eigen::Map<const VectorXd> x = sample_col(i, ws);
+    for (int c = 0; c < G.cols(); c++) {
+      double v = x(c);
+      if (v == 0) continue;
+      double * g = G.col(c).data();
+      for (size_t t = 0; t < kept.size(); t++) {
+        g[kept[t]] += v * s(t);
+      }
+    }
+  }
+}
+
+
+// beta * d KL(sparsity_param || rho) / d rho
+void autoencoder::kl_sigma(const Eigen::Ref<const MatrixXd> & rho, Eigen::Ref<VectorXd> out) const {
+  out = (beta * (-sparsity_param/rho.array() +\
+                 (1-sparsity_param)/(1-rho.array()))).matrix();
+}
+
+
+// exponentially averaged rho of the current layer, kept per worker so the
+// stochastic trainers never need a full data pass
+void autoencoder::rho_update(int lyr, const Eigen::Ref<const VectorXd> & rho_batch) {
+  rho_update(rho_est[lyr], rho_batch);
+}
+
+void autoencoder::rho_update(MatrixXd & rho, const Eigen::Ref<const VectorXd> & rho_batch) const {
+  rho = rho_decay * rho + (1 - rho_decay) * rho_batch;
+}
+
+
+// seed the running rho from (at most) the first 1000 samples
+void autoencoder::rho_init(int lyr) {
+  int n = std::min(n_samples(), 1000);
+  rho_est[lyr] = MatrixXd::Zero(layer_size[lyr+1], 1);
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t a2 = ws.vec(layer_size[lyr+1]);
+  for (int i = 0; i < n; i++) {
+    encode(lyr, i, a2);
+    rho_est[lyr] += a2;
+  }
+  rho_est[lyr] /= std::max(n, 1);
+  rho_pulled = rho_est[lyr];
+}
+
+
 // for DAE
 inline void autoencoder::corrupt_data(){
   assert(corrupt);
@@ -335,49 +845,35 @@ inline void autoencoder::corrupt_data(){
 void autoencoder::distribute_bgd(int lyr){
   // flag
   std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
-  _paracel_write("W1", WgtBias[lyr].at("W1"));
-  _paracel_write("W2", WgtBias[lyr].at("W2"));
-  _paracel_write("b1", WgtBias[lyr].at("b1"));
-  _paracel_write("b2", WgtBias[lyr].at("b2"));
-  paracel_register_bupdate("/mfs/user/zhaojunbo/paracel/build/lib/libae_update.so", 
-      "ae_update");
+  _paracel_write_lyr(lyr);
+  paracel_register_bupdate(update_lib, "ae_update");
   unordered_map<string, MatrixXd> delta;
-  delta["W1"] = MatrixXd::Zero(WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-  delta["W2"] = MatrixXd::Zero(WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-  delta["b1"] = VectorXd::Zero(WgtBias[lyr].at("b1").size());
-  delta["b2"] = VectorXd::Zero(WgtBias[lyr].at("b2").size());
+  for (auto & kv : WgtBias[lyr]) {
+    delta[kv.first] = MatrixXd::Zero(kv.second.rows(), kv.second.cols());
+  }
   for (int rd = 0; rd < rounds; rd++) {
-    WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-    WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-    WgtBias[lyr].at("b1") = _paracel_read("b1");
-    WgtBias[lyr].at("b2") = _paracel_read("b2");
+    alpha = lr_at(rd);
+    _paracel_read_lyr(lyr);
     delta = ae_batch_grad(lyr);
-    delta.at("W1") = (-alpha * delta.at("W1").array()).matrix();
-    delta.at("W2") = (-alpha * delta.at("W2").array()).matrix();
-    delta.at("b1") = (-alpha * delta.at("b1").array()).matrix();
-    delta.at("b2") = (-alpha * delta.at("b2").array()).matrix();
+    for (auto & kv : delta) {
+      kv.second = (-alpha * kv.second.array()).matrix();
+    }
     if (debug) {
       loss_error.push_back(ae_cost(lyr));
     }
     // push
-    _paracel_bupdate("W1", delta.at("W1"));
-    _paracel_bupdate("W2", delta.at("W2"));
-    _paracel_bupdate("b1", delta.at("b1"));
-    _paracel_bupdate("b2", delta.at("b2"));
+    _paracel_bupdate_lyr(lyr, delta);
     iter_commit();
     
     // flag
-    WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-    WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-    WgtBias[lyr].at("b1") = _paracel_read("b1");
-    WgtBias[lyr].at("b2") = _paracel_read("b2");
+    _paracel_read_lyr(lyr);
     std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+    if (converged(lyr, rd)) {
+      break;
+    }
   } // rounds
   // last pull
-  WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-  WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-  WgtBias[lyr].at("b1") = _paracel_read("b1");
-  WgtBias[lyr].at("b2") = _paracel_read("b2");
+  _paracel_read_lyr(lyr);
 }
 
 
@@ -388,76 +884,625 @@ void autoencoder::downpour_sgd(int lyr){
   int cnt = 0;
   if (read_batch == 0) { read_batch = 10; }
   if (update_batch == 0) { update_batch = 10; }
-  // Reference operator
-  unordered_map<string, MatrixXd>& WgtBias_lyr = WgtBias[lyr] ;
-  _paracel_write("W1", WgtBias_lyr.at("W1"));
-  _paracel_write("W2", WgtBias_lyr.at("W2"));
-  _paracel_write("b1", WgtBias_lyr.at("b1"));
-  _paracel_write("b2", WgtBias_lyr.at("b2"));
+  _paracel_write_lyr(lyr);
   vector<int> idx;
-  for (int i = 0; i < data.cols(); i++) {
+  for (int i = 0; i < n_samples(); i++) {
     idx.push_back(i);
   }
-  paracel_register_bupdate("/mfs/user/zhaojunbo/paracel/build/lib/libae_update.so", 
-      "ae_update");
+  paracel_register_bupdate(update_lib, "ae_update");
   unordered_map<string, MatrixXd> delta;
-  delta["W1"] = MatrixXd::Zero(WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-  delta["W2"] = MatrixXd::Zero(WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-  delta["b1"] = VectorXd::Zero(WgtBias[lyr].at("b1").size());
-  delta["b2"] = VectorXd::Zero(WgtBias[lyr].at("b2").size());
+  for (auto & kv : WgtBias[lyr]) {
+    delta[kv.first] = MatrixXd::Zero(kv.second.rows(), kv.second.cols());
+  }
 
+  unordered_map<string, MatrixXd> WgtBias_grad;  // reused by every step
+  // samples of the coming round and samples per second of the last one
+  int quota = n_samples();
+  double rate = 0.;
   for (int rd = 0; rd < rounds; rd++) {
-    std::random_shuffle(idx.begin(), idx.end());
-
-    // init read
-    WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-    WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-    WgtBias[lyr].at("b1") = _paracel_read("b1");
-    WgtBias[lyr].at("b2") = _paracel_read("b2");
-    unordered_map<string, MatrixXd> WgtBias_lyr_old(WgtBias[lyr]);
-
-    // traverse data
-    cnt = 0;
-    for (auto sample_id : idx) {
-      if ( (cnt % read_batch == 0) || (cnt == (int)idx.size() - 1) ) {
-        WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-        WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-        WgtBias[lyr].at("b1") = _paracel_read("b1");
-        WgtBias[lyr].at("b2") = _paracel_read("b2");
-        WgtBias_lyr_old = WgtBias[lyr];
-      }
-      unordered_map<string, MatrixXd> WgtBias_grad = ae_stoc_grad(lyr, sample_id);
-      WgtBias[lyr].at("W1") -= (alpha * WgtBias_grad["W1"].array()).matrix();
-      WgtBias[lyr].at("W2") -= (alpha * WgtBias_grad["W2"].array()).matrix();
-      WgtBias[lyr].at("b1") -= (alpha * WgtBias_grad["b1"].array()).matrix();
-      WgtBias[lyr].at("b2") -= (alpha * WgtBias_grad["b2"].array()).matrix();
+    alpha = lr_at(rd);
+    if (rebalance && rd > 0 && round_budget <= 0) {
+      quota = round_quota(lyr, rd, rate);
+    }
+    vector<int> order = round_order(idx, quota);
+    // pull and push as often per round as with an even split
+    double scale = n_samples() ? quota / double(n_samples()) : 1.;
+    int read_every = std::max(1, int(std::lround(read_batch * scale)));
+    int push_every = std::max(1, int(std::lround(update_batch * scale)));
+    auto t0 = std::chrono::steady_clock::now();
+    double t_log = 0.;  // cost printing, not part of the rate
+
+    // traverse data; a worker without samples only joins sync()
+    for (cnt = 0; !order.empty(); cnt++) {
+      bool last = round_budget > 0 ? seconds_since(t0) >= round_budget : cnt == (int)order.size() - 1;
+      if (cnt == (int)order.size()) {  // budget outlasts the pass
+        vector<int> more = round_order(idx, n_samples());
+        order.insert(order.end(), more.begin(), more.end());
+      }
+      if ( (cnt % read_every == 0) || last ) {
+        _paracel_read_lyr(lyr);
+        // unpushed updates were just overwritten by the pull
+        zero_delta(delta);
+      }
+      ae_stoc_grad(lyr, order[cnt], WgtBias_grad);
+      apply_step(lyr, WgtBias_grad, delta);
       if (debug) {
         loss_error.push_back(ae_cost(lyr));
       }
-      if ( (cnt % update_batch == 0) || (cnt == (int)idx.size() - 1) ) {
-        delta.at("W1") = WgtBias[lyr].at("W1") - WgtBias_lyr_old.at("W1");
-        delta.at("W2") = WgtBias[lyr].at("W2") - WgtBias_lyr_old.at("W2");
-        delta.at("b1") = WgtBias[lyr].at("b1") - WgtBias_lyr_old.at("b1");
-        delta.at("b2") = WgtBias[lyr].at("b2") - WgtBias_lyr_old.at("b2");
+      if ( (cnt % push_every == 0) || last ) {
         // push
-        _paracel_bupdate("W1", delta.at("W1"));
-        _paracel_bupdate("W2", delta.at("W2"));
-        _paracel_bupdate("b1", delta.at("b1"));
-        _paracel_bupdate("b2", delta.at("b2"));
+        _paracel_bupdate_lyr(lyr, delta);
+        zero_delta(delta);
         iter_commit();
         // flag
+        auto t1 = std::chrono::steady_clock::now();
         std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+        t_log += seconds_since(t1);
+      }
+      if (last) {
+        break;
       }
-      cnt += 1;
     } // traverse
+    int n_done = order.empty() ? 0 : cnt + 1;
+    rate = n_done / std::max(seconds_since(t0) - t_log, 1e-9);
     sync();
+    std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << ", " << n_done << " samples at " << rate << " samples/sec" << std::endl;
+    if (converged(lyr, rd)) {
+      break;
+    }
+  }  // rounds
+  // last pull
+  _paracel_read_lyr(lyr);
+}
+
+
+// threads of one hogwild layer, started once and pinned once: every
+// run(f) has thread t call f(t) and returns when all of them are done
+class hogwild_team {
+ public:
+  hogwild_team(int n, const vector<int> & cpus) {
+    for (int t = 0; t < n; t++) {
+      threads.push_back(std::thread([this, t, cpus] () { loop(t, cpus); }));
+    }
+  }
+  ~hogwild_team() {
+    {
+      std::lock_guard<std::mutex> lk(mu);
+      stop = true;
+    }
+    start.notify_all();
+    for (auto & th : threads) {
+      th.join();
+    }
+  }
+  void run(const std::function<void(int)> & f) {
+    std::unique_lock<std::mutex> lk(mu);
+    job = &f;
+    n_done = 0;
+    gen += 1;
+    start.notify_all();
+    done.wait(lk, [this] () { return n_done == (int)threads.size(); });
+    job = nullptr;
+  }
+
+ private:
+  void loop(int t, const vector<int> & cpus) {
+    if (cpus.size()) {
+      pin_cpus(vector<int>{cpus[t % cpus.size()]});
+    }
+    long seen = 0;
+    while (true) {
+      const std::function<void(int)> * f;
+      {
+        std::unique_lock<std::mutex> lk(mu);
+        start.wait(lk, [&] () { return stop || gen != seen; });
+        if (stop) {
+          return;
+        }
+        seen = gen;
+        f = job;
+      }
+      (*f)(t);
+      std::lock_guard<std::mutex> lk(mu);
+      if (++n_done == (int)threads.size()) {
+        done.notify_one();
+      }
+    }
+  }
+
+  vector<std::thread> threads;
+  std::mutex mu;
+  std::condition_variable start, done;
+  const std::function<void(int)> * job = nullptr;
+  long gen = 0;
+  int n_done = 0;
+  bool stop = false;
+};
+
+// the weight decay of the n samples between two exchanges in one step,
+// (1 - step * decay) compounded n times, mirrored into delta like the
+// gradient steps
+void autoencoder::hogwild_decay(int lyr, double step, int n, unordered_map<string, MatrixXd> & delta) {
+  for (auto & kv : WgtBias[lyr]) {
+    if (kv.first[0] == 'W') {
+      double decay = (kv.first == "W1") ? w1_lamb() : lamb;
+      double f = std::pow(1. - step * decay, n);
+      delta.at(kv.first) -= (1. - f) * kv.second;
+      kv.second *= f;
+    }
+  }
+}
+
+// hogwild downpour sgd: n_threads threads share WgtBias[lyr] and update it
+// without locks; the merged result is exchanged with the servers only once
+// every sync_interval samples per thread. Dropout is not supported, the
+// constructor rejects it
+void autoencoder::downpour_sgd_hogwild(int lyr){
+  // flag
+  std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+  if (n_threads < 1) { n_threads = 1; }
+  if (sync_interval == 0) { sync_interval = 1000; }
+  _paracel_write_lyr(lyr);
+  vector<int> idx;
+  for (int i = 0; i < n_samples(); i++) {
+    idx.push_back(i);
+  }
+  paracel_register_bupdate(update_lib, "ae_update");
+  unordered_map<string, MatrixXd> delta;
+  for (auto & kv : WgtBias[lyr]) {
+    delta[kv.first] = MatrixXd::Zero(kv.second.rows(), kv.second.cols());
+  }
+  int chunk = n_threads * sync_interval;
+  // running rho of every thread, started from rho_est and averaged back
+  // into it before each push
+  vector<MatrixXd> rho_thr(n_threads, beta != 0 ? rho_est[lyr] : MatrixXd());
+  // cpus the rank is pinned to, one per thread
+  hogwild_team team(n_threads, pin_threads ? allowed_cpus() : vector<int>());
+
+  for (int rd = 0; rd < rounds; rd++) {
+    alpha = lr_at(rd);
+    std::random_shuffle(idx.begin(), idx.end());
+
+    // traverse data, one exchange per chunk
+    for (size_t st = 0; st < idx.size(); st += chunk) {
+      size_t en = std::min(idx.size(), st + chunk);
+      _paracel_read_lyr(lyr);
+      zero_delta(delta);
+
+      for (auto & rho : rho_thr) {
+        rho = rho_est[lyr];
+      }
+
+      team.run([&] (int t) {
+        for (size_t k = st + t; k < en; k += n_threads) {
+          ae_stoc_update(lyr, idx[k], alpha, delta, rho_thr[t]);
+        }
+      });
+      if (beta != 0) {
+        rho_est[lyr].setZero();
+        for (auto & rho : rho_thr) {
+          rho_est[lyr] += rho / n_threads;
+        }
+      }
+      if (lamb != 0) {
+        hogwild_decay(lyr, alpha, en - st, delta);
+      }
+      if (debug) {
+        loss_error.push_back(ae_cost(lyr));
+      }
+
+      // push
+      _paracel_bupdate_lyr(lyr, delta);
+      iter_commit();
+    } // traverse
+    sync();
+    std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
     std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << std::endl;
+    if (converged(lyr, rd)) {
+      break;
+    }
   }  // rounds
   // last pull
-  WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-  WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-  WgtBias[lyr].at("b1") = _paracel_read("b1");
-  WgtBias[lyr].at("b2") = _paracel_read("b2");
+  _paracel_read_lyr(lyr);
+}
+
+
+// sample order of one round: quota ids taken from fresh shuffles of idx
+vector<int> autoencoder::round_order(vector<int> & idx, int quota) const {
+  vector<int> order;
+  while ((int)order.size() < quota && idx.size()) {
+    std::random_shuffle(idx.begin(), idx.end());
+    int n = std::min((int)idx.size(), quota - (int)order.size());
+    order.insert(order.end(), idx.begin(), idx.begin() + n);
+  }
+  return order;
+}
+
+// cut an order into mini-batches, a trailing batch of a single sample is dropped
+vector<vector<int>> autoencoder::mibt_split(const vector<int> & order) const {
+  vector<vector<int>> mibt_idx;
+  for (auto i = order.begin(); ; i += mibt_size) {
+    if (order.end() - i < mibt_size) {
+      if (order.end() - i >= 2) {
+        mibt_idx.push_back(vector<int>(i, order.end()));
+      }
+      break;
+    }
+    // SUPPOSE IT TO BE NOT ACCUMULATED OVER WORKERS?
+    mibt_idx.push_back(vector<int>(i, i + mibt_size));
+  }
+  return mibt_idx;
+}
+
+// share the samples/sec of the last round through the servers and size
+// this worker's next round in proportion to its rate, so that all workers
+// reach sync() together while the total work per round stays the same
+int autoencoder::round_quota(int lyr, int rd, double rate) {
+  paracel_write(round_key("rate_", lyr, rd, get_worker_id()), vector<double>{rate, (double)n_samples()});
+  sync();
+  vector<double> rates;
+  double sum_rate = 0., sum_n = 0.;
+  for (int w = 0; w < get_worker_size(); w++) {
+    auto v = paracel_read<vector<double> >(round_key("rate_", lyr, rd, w));
+    rates.push_back(v[0]);
+    sum_rate += v[0];
+    sum_n += v[1];
+  }
+  if (get_worker_id() == 0) {
+    vector<double> sorted(rates);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    double median = sorted[sorted.size() / 2];
+    for (size_t w = 0; w < rates.size(); w++) {
+      if (rates[w] < straggler_ratio * median) {
+        std::cout << "worker" << w << " is a straggler: " << rates[w] << " samples/sec against a median of " << median << std::endl;
+      }
+    }
+  }
+  if (sum_rate <= 0) {
+    return std::max(1, int(std::lround(sum_n / get_worker_size())));
+  }
+  return std::max(1, int(std::lround(sum_n * rate / sum_rate)));
+}
+
+// step size of round rd of a layer; every layer starts over from alpha0
+double autoencoder::lr_at(int rd) const {
+  if (lr_schedule == "step") {
+    return alpha0 * std::pow(lr_decay, rd / std::max(lr_step, 1));
+  } else if (lr_schedule == "exp") {
+    return alpha0 * std::pow(lr_decay, rd);
+  } else if (lr_schedule == "cosine") {
+    return lr_min + (alpha0 - lr_min) * (1 + std::cos(M_PI * rd / std::max(rounds - 1, 1))) / 2;
+  }
+  return alpha0;
+}
+
+// early stopping needs both a patience and samples to test on
+bool autoencoder::early_stopping() const {
+  return patience > 0 && holdout > 0;
+}
+
+// move a random holdout fraction of the local samples out of the training
+// data into hold; they follow the data up the layers and only serve the
+// early stopping test
+void autoencoder::holdout_split() {
+  int n = n_samples();
+  int n_hold = std::min(int(holdout * n), n - 1);
+  if (n_hold <= 0) {
+    return;
+  }
+  vector<int> id(n);
+  for (int i = 0; i < n; i++) {
+    id[i] = i;
+  }
+  std::random_shuffle(id.begin(), id.end());
+  vector<bool> is_hold(n, false);
+  for (int k = 0; k < n_hold; k++) {
+    is_hold[id[k]] = true;
+  }
+  hold.resize(layer_size[0], n_hold);
+  int col = 0, h = 0;
+  if (sparse_input) {
+    vector<Eigen::Triplet<double> > trips;
+    for (int i = 0; i < n; i++) {
+      if (is_hold[i]) {
+        hold.col(h++) = VectorXd(sdata.col(i));
+        continue;
+      }
+      for (Eigen::SparseMatrix<double>::InnerIterator it(sdata, i); it; ++it) {
+        trips.push_back(Eigen::Triplet<double>(it.index(), col, it.value()));
+      }
+      col += 1;
+    }
+    sdata.resize(layer_size[0], col);
+    sdata.setFromTriplets(trips.begin(), trips.end());
+    sdata.makeCompressed();
+  } else {
+    for (int i = 0; i < n; i++) {
+      if (is_hold[i]) {
+        hold.col(h++) = data.col(i);
+      } else {
+        data.col(col++) = data.col(i);
+      }
+    }
+    data.conservativeResize(Eigen::NoChange, col);
+  }
+  std::cout << "worker" << get_worker_id() << " holds out " << n_hold << " of " << n << " samples" << std::endl;
+}
+
+// reconstruction cost summed over the local holdout samples
+double autoencoder::holdout_cost(int lyr) const {
+  workspace & ws = scratch();
+  workspace::frame fr(ws);
+  workspace::vec_t a2 = ws.vec(layer_size[lyr+1]);
+  workspace::vec_t a3 = ws.vec(layer_size[lyr]);
+  double cost = 0;
+  for (int j = 0; j < hold.cols(); j++) {
+    a2.noalias() = WgtBias[lyr].at("W1") * hold.col(j);
+    a2 += WgtBias[lyr].at("b1");
+    acti_apply(a2);
+    decode(lyr, a2, a3);
+    a3 -= hold.col(j);
+    cost += a3.squaredNorm() / 2;
+  }
+  return cost;
+}
+
+// mean holdout cost over all workers of the pulled weights at the end of
+// round rd. The layer is done once it has not dropped by a relative
+// min_delta for patience rounds; every worker reads the same sums and
+// stops in the same round
+bool autoencoder::converged(int lyr, int rd) {
+  if (!early_stopping()) {
+    return false;
+  }
+  double sum[2] = {0., 0.};  // cost, samples
+  if (allreduce_mode()) {
+    sum[0] = holdout_cost(lyr);
+    sum[1] = hold.cols();
+    MPI_Allreduce(MPI_IN_PLACE, sum, 2, MPI_DOUBLE, MPI_SUM, ar_comm.get_comm());
+  } else {
+    _paracel_read_lyr(lyr);
+    paracel_write(round_key("hold_", lyr, rd, get_worker_id()), vector<double>{holdout_cost(lyr), (double)hold.cols()});
+    sync();
+    for (int w = 0; w < get_worker_size(); w++) {
+      auto v = paracel_read<vector<double> >(round_key("hold_", lyr, rd, w));
+      sum[0] += v[0];
+      sum[1] += v[1];
+    }
+  }
+  double cost = sum[0] / std::max(sum[1], 1.);
+  last_hold = cost;
+  if (rd == 0 || cost < best_hold * (1 - min_delta)) {
+    best_hold = cost;
+    n_stale = 0;
+  } else {
+    n_stale += 1;
+  }
+  if (get_worker_id() == 0) {
+    std::cout << "layer " << lyr << " rd " << rd << ", holdout cost: " << cost << ", alpha: " << alpha << std::endl;
+    if (n_stale >= patience) {
+      std::cout << "layer " << lyr << " converged after " << rd + 1 << " rounds" << std::endl;
+    }
+  }
+  return n_stale >= patience;
+}
+
+
+// The per-round scalars of a worker live under one key per layer, rewritten
+// every round. Two keys alternate by round parity: a worker that is already
+// a round ahead writes the other one, so a slower worker still reading the
+// last round after sync() never sees a value of the next one.
+string autoencoder::round_key(const string & what, int lyr, int rd, int wid) const {
+  return key_prefix + what + std::to_string(lyr) + "_" + std::to_string(rd % 2) + "_" + std::to_string(wid);
+}
+
+// drop the round keys of a finished layer once every worker is past its
+// last read of them
+void autoencoder::clear_round_keys(int lyr) {
+  sync();
+  for (const char * what : {"rate_", "hold_"}) {
+    for (int rd = 0; rd < 2; rd++) {
+      paracel_remove(round_key(what, lyr, rd, get_worker_id()));
+    }
+  }
+}
+
+
+bool autoencoder::allreduce_mode() const {
+  return allreduce_method(learning_method);
+}
+
+// The servers sum the deltas of the workers, so the allreduce trainers
+// step by the sum of the workers' gradients too and keep alpha
+// interchangeable with dbgd and mbdsgd. Keys go in name order, which
+// every worker agrees on. The ring starts once the whole gradient of the
+// step is there, it does not overlap the backward pass: the next step
+// needs the weights this sum updates
+void autoencoder::allreduce_sum(unordered_map<string, MatrixXd> & grad) {
+  vector<string> keys;
+  size_t n = 0;
+  for (auto & kv : grad) {
+    keys.push_back(kv.first);
+    n += kv.second.size();
+  }
+  std::sort(keys.begin(), keys.end());
+  ar_buf.resize(n);
+  size_t off = 0;
+  for (auto & k : keys) {
+    MatrixXd & g = grad.at(k);
+    MatrixXd::Map(&ar_buf[off], g.rows(), g.cols()) = g;
+    off += g.size();
+  }
+  ring_allreduce(ar_buf.data(), n, ar_comm.get_comm(), ar_chunk);
+  off = 0;
+  for (auto & k : keys) {
+    MatrixXd & g = grad.at(k);
+    g = MatrixXd::Map(&ar_buf[off], g.rows(), g.cols());
+    off += g.size();
+  }
+}
+
+void autoencoder::bcast_lyr(int lyr) {
+  vector<string> keys;
+  for (auto & kv : WgtBias[lyr]) {
+    keys.push_back(kv.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  for (auto & k : keys) {
+    MatrixXd & m = WgtBias[lyr].at(k);
+    MPI_Bcast(m.data(), m.size(), MPI_DOUBLE, 0, ar_comm.get_comm());
+  }
+}
+
+// dbgd with the gradient summed over a ring of the workers instead of
+// through the servers; every worker holds and steps the same weights
+void autoencoder::allreduce_bgd(int lyr){
+  // flag
+  std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+  bcast_lyr(lyr);
+  unordered_map<string, MatrixXd> grad;
+  for (int rd = 0; rd < rounds; rd++) {
+    alpha = lr_at(rd);
+    // a worker without samples adds nothing to the sum
+    if (n_samples()) {
+      grad = ae_batch_grad(lyr);
+    } else {
+      grad_zero(grad, WgtBias[lyr]);
+    }
+    allreduce_sum(grad);
+    for (auto & kv : grad) {
+      WgtBias[lyr].at(kv.first) -= alpha * kv.second;
+    }
+    if (debug) {
+      loss_error.push_back(ae_cost(lyr));
+    }
+
+    // flag
+    std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+    if (converged(lyr, rd)) {
+      break;
+    }
+  } // rounds
+}
+
+// synchronous mini-batch sgd: every step sums the mini-batch gradients of
+// all workers over the ring and applies them at once
+void autoencoder::allreduce_sgd_mibt(int lyr){
+  // flag
+  std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+  bcast_lyr(lyr);
+  vector<int> idx;
+  for (int i = 0; i < n_samples(); i++) {
+    idx.push_back(i);
+  }
+  // the same number of steps on every worker, those with fewer samples
+  // go round their samples again
+  int quota = n_samples();
+  MPI_Allreduce(MPI_IN_PLACE, &quota, 1, MPI_INT, MPI_MAX, ar_comm.get_comm());
+  // a worker without samples still joins every sum, with a zero gradient
+  size_t n_steps = mibt_split(vector<int>(quota)).size();
+  unordered_map<string, MatrixXd> WgtBias_grad;  // reused by every step
+  for (int rd = 0; rd < rounds; rd++) {
+    alpha = lr_at(rd);
+    vector<vector<int>> mibt_idx = mibt_split(round_order(idx, quota));
+    auto t0 = std::chrono::steady_clock::now();
+    int n_done = 0;
+    for (size_t k = 0; k < n_steps; k++) {
+      if (k < mibt_idx.size()) {
+        ae_mibt_stoc_grad(lyr, mibt_idx[k], WgtBias_grad);
+        n_done += mibt_idx[k].size();
+      } else {
+        grad_zero(WgtBias_grad, WgtBias[lyr]);
+      }
+      allreduce_sum(WgtBias_grad);
+      for (auto & kv : WgtBias_grad) {
+        WgtBias[lyr].at(kv.first) -= alpha * kv.second;
+      }
+      if (debug) {
+        loss_error.push_back(ae_cost(lyr));
+      }
+    }
+    double rate = n_done / std::max(seconds_since(t0), 1e-9);
+    std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+    std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << ", " << n_done << " samples at " << rate << " samples/sec" << std::endl;
+    if (converged(lyr, rd)) {
+      break;
+    }
+  }  // rounds
+}
+
+
+// Elastic averaging sgd. Each worker runs plain mini-batch sgd on its own
+// copy and, every easgd_tau steps, moves it towards the center variable
+// held by the servers: both take a step of beta / workers times their
+// difference, the worker towards the center and the center, through the
+// summing bupdate, towards the worker. Servers are touched once per
+// easgd_tau mini-batches instead of every read_batch and update_batch
+void autoencoder::elastic_sgd_mibt(int lyr){
+  // flag
+  std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+  _paracel_write_lyr(lyr);
+  paracel_register_bupdate(update_lib, "ae_update");
+  vector<int> idx;
+  for (int i = 0; i < n_samples(); i++) {
+    idx.push_back(i);
+  }
+  double mv = easgd_beta / get_worker_size();
+  int tau = std::max(easgd_tau, 1);
+  unordered_map<string, MatrixXd> center;  // pulled center, then the elastic move
+  for (auto & kv : WgtBias[lyr]) {
+    center[kv.first] = MatrixXd::Zero(kv.second.rows(), kv.second.cols());
+  }
+  unordered_map<string, MatrixXd> WgtBias_grad;  // reused by every step
+  unordered_map<string, MatrixXd> local;
+  for (int rd = 0; rd < rounds; rd++) {
+    alpha = lr_at(rd);
+    vector<vector<int>> mibt_idx = mibt_split(round_order(idx, n_samples()));
+    auto t0 = std::chrono::steady_clock::now();
+    int n_done = 0, n_exch = 0;
+    for (size_t k = 0; k < mibt_idx.size(); k++) {
+      ae_mibt_stoc_grad(lyr, mibt_idx[k], WgtBias_grad);
+      for (auto & kv : WgtBias_grad) {
+        WgtBias[lyr].at(kv.first) -= alpha * kv.second;
+      }
+      n_done += mibt_idx[k].size();
+      if (debug) {
+        loss_error.push_back(ae_cost(lyr));
+      }
+      if ((k + 1) % tau == 0 || k + 1 == mibt_idx.size()) {
+        for (auto & kv : center) {
+          MatrixXd & w = WgtBias[lyr].at(kv.first);
+          _paracel_read_shard(kv.first, kv.second);
+          kv.second = mv * (w - kv.second);
+          w -= kv.second;
+          _paracel_bupdate_shard(kv.first, kv.second);
+        }
+        n_exch += 1;
+        iter_commit();
+      }
+    }
+    double rate = n_done / std::max(seconds_since(t0), 1e-9);
+    sync();
+    std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+    std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << ", " << n_done << " samples at " << rate
+              << " samples/sec, " << n_exch << " exchanges" << std::endl;
+    // the holdout test pulls the center, the worker goes on from its own
+    // copy; without early stopping nothing is pulled and nothing copied
+    bool stop;
+    if (early_stopping()) {
+      local = WgtBias[lyr];
+      stop = converged(lyr, rd);
+      WgtBias[lyr].swap(local);
+    } else {
+      stop = converged(lyr, rd);
+    }
+    if (stop) {
+      break;
+    }
+  }  // rounds
+  // the center is the result
+  sync();
+  _paracel_read_lyr(lyr);
 }
 
 
@@ -469,136 +1514,215 @@ void autoencoder::downpour_sgd_mibt(int lyr){  // TODO Adagrad
   if (read_batch == 0) { read_batch = 4; }
   if (update_batch == 0) { update_batch = 4; }
   // Reference operator
-  _paracel_write("W1", WgtBias[lyr].at("W1"));
-  _paracel_write("W2", WgtBias[lyr].at("W2"));
-  _paracel_write("b1", WgtBias[lyr].at("b1"));
-  _paracel_write("b2", WgtBias[lyr].at("b2"));
+  _paracel_write_lyr(lyr);
   vector<int> idx;
 //std::cout << get_worker_id() << " ok1" << std::endl;
-  for (int i = 0; i < data.cols(); i++) {
+  for (int i = 0; i < n_samples(); i++) {
     idx.push_back(i);
   }
   // ABSOULTE PATH
-  paracel_register_bupdate("/mfs/user/zhaojunbo/paracel/build/lib/libae_update.so", 
-      "ae_update");
+  paracel_register_bupdate(update_lib, "ae_update");
   unordered_map<string, MatrixXd> delta;
-  delta["W1"] = MatrixXd::Zero(WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-  delta["W2"] = MatrixXd::Zero(WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-  delta["b1"] = VectorXd::Zero(WgtBias[lyr].at("b1").size());
-  delta["b2"] = VectorXd::Zero(WgtBias[lyr].at("b2").size());
+  for (auto & kv : WgtBias[lyr]) {
+    delta[kv.first] = MatrixXd::Zero(kv.second.rows(), kv.second.cols());
+  }
 //std::cout << get_worker_id() << " ok2" << std::endl;
-
+  unordered_map<string, MatrixXd> WgtBias_grad;  // reused by every step
+  int quota = n_samples();
+  double rate = 0.;
   for (int rd = 0; rd < rounds; rd++) {
-    std::random_shuffle(idx.begin(), idx.end());
-    vector<vector<int>> mibt_idx; // mini-batch id
-    for (auto i = idx.begin(); ; i += mibt_size) {
-      if (idx.end() - i < mibt_size) {
-        if (idx.end() - i < 2) { // point to the back() or out of range  
-          break;
-        }else{
-          vector<int> tmp;
-          tmp.assign(i, idx.end());
-          mibt_idx.push_back(tmp);
-          break;
+    alpha = lr_at(rd);
+    if (rebalance && rd > 0 && round_budget <= 0) {
+      quota = round_quota(lyr, rd, rate);
+    }
+    vector<vector<int>> mibt_idx = mibt_split(round_order(idx, quota)); // mini-batch id
+    double scale = n_samples() ? quota / double(n_samples()) : 1.;
+    int read_every = std::max(1, int(std::lround(read_batch * scale)));
+    int push_every = std::max(1, int(std::lround(update_batch * scale)));
+    auto t0 = std::chrono::steady_clock::now();
+    double t_log = 0.;
+    int n_done = 0;
+    // traverse data; a worker without samples only joins sync()
+    for (mibt_cnt = 0; mibt_cnt < (int)mibt_idx.size(); mibt_cnt++) {
+      bool last = mibt_cnt == (int)mibt_idx.size() - 1;
+      if (round_budget > 0) {
+        if (seconds_since(t0) >= round_budget) {
+          last = true;
+        } else if (last) {  // budget outlasts the pass, queue another one
+          vector<vector<int>> more = mibt_split(round_order(idx, n_samples()));
+          mibt_idx.insert(mibt_idx.end(), more.begin(), more.end());
+          last = mibt_cnt == (int)mibt_idx.size() - 1;
         }
       }
-      vector<int> tmp;
-      tmp.assign(i, i + mibt_size);
-      // SUPPOSE IT TO BE NOT ACCUMULATED OVER WORKERS?
-      mibt_idx.push_back(tmp);
-    }
-    // init push
-    WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-    WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-    WgtBias[lyr].at("b1") = _paracel_read("b1");
-    WgtBias[lyr].at("b2") = _paracel_read("b2");
-    unordered_map<string, MatrixXd> WgtBias_lyr_old(WgtBias[lyr]);
-//std::cout << get_worker_id() << " ok3" << std::endl;
-    
-    // traverse data
-    mibt_cnt = 0;
-    for (auto mibt_sample_id : mibt_idx) {
-      if ( (mibt_cnt % read_batch == 0) || (mibt_cnt == (int)mibt_idx.size()-1) ) {
-        WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-        WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-        WgtBias[lyr].at("b1") = _paracel_read("b1");
-        WgtBias[lyr].at("b2") = _paracel_read("b2");
-        WgtBias_lyr_old = WgtBias[lyr];
-//std::cout << get_worker_id() << " ok4" << std::endl;
-      }
-      unordered_map<string, MatrixXd> WgtBias_grad = ae_mibt_stoc_grad(lyr, mibt_sample_id);
-      WgtBias[lyr].at("W1") -= (alpha * WgtBias_grad["W1"].array()).matrix();
-      WgtBias[lyr].at("W2") -= (alpha * WgtBias_grad["W2"].array()).matrix();
-      WgtBias[lyr].at("b1") -= (alpha * WgtBias_grad["b1"].array()).matrix();
-      WgtBias[lyr].at("b2") -= (alpha * WgtBias_grad["b2"].array()).matrix();
+      if ( (mibt_cnt % read_every == 0) || last ) {
+        _paracel_read_lyr(lyr);
+        zero_delta(delta);
+      }
+      ae_mibt_stoc_grad(lyr, mibt_idx[mibt_cnt], WgtBias_grad);
+      apply_step(lyr, WgtBias_grad, delta);
+      n_done += mibt_idx[mibt_cnt].size();
       if (debug) {
         loss_error.push_back(ae_cost(lyr));
       }
-      if ( (mibt_cnt % update_batch == 0) || (mibt_cnt == (int)mibt_idx.size()-1) ) {
-        delta.at("W1") = WgtBias[lyr].at("W1") - WgtBias_lyr_old.at("W1");
-        delta.at("W2") = WgtBias[lyr].at("W2") - WgtBias_lyr_old.at("W2");
-        delta.at("b1") = WgtBias[lyr].at("b1") - WgtBias_lyr_old.at("b1");
-        delta.at("b2") = WgtBias[lyr].at("b2") - WgtBias_lyr_old.at("b2");
+      if ( (mibt_cnt % push_every == 0) || last ) {
         // push
-        _paracel_bupdate("W1", delta.at("W1"));
-        _paracel_bupdate("W2", delta.at("W2"));
-        _paracel_bupdate("b1", delta.at("b1"));
-        _paracel_bupdate("b2", delta.at("b2"));
+        _paracel_bupdate_lyr(lyr, delta);
+        zero_delta(delta);
         iter_commit();
-//std::cout << get_worker_id() << " ok5" << std::endl;
         // flag
+        auto t1 = std::chrono::steady_clock::now();
         std::cout << "worker" << get_worker_id() << ", cost: " << ae_cost(lyr) << std::endl;
+        t_log += seconds_since(t1);
+      }
+      if (last) {
+        break;
       }
-      mibt_cnt += 1;
     }  // traverse
-//std::cout << get_worker_id() << " ok6" << std::endl;
+    rate = n_done / std::max(seconds_since(t0) - t_log, 1e-9);
     sync();
-    std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << std::endl;
+    std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << ", " << n_done << " samples at " << rate << " samples/sec" << std::endl;
+    if (converged(lyr, rd)) {
+      break;
+    }
   }  // rounds
   // last pull
-  WgtBias[lyr].at("W1") = _paracel_read("W1", WgtBias[lyr].at("W1").rows(), WgtBias[lyr].at("W1").cols());
-  WgtBias[lyr].at("W2") = _paracel_read("W2", WgtBias[lyr].at("W2").rows(), WgtBias[lyr].at("W2").cols());
-  WgtBias[lyr].at("b1") = _paracel_read("b1");
-  WgtBias[lyr].at("b2") = _paracel_read("b2");
+  _paracel_read_lyr(lyr);
 }
 
 
-void autoencoder::train(int lyr){
-  if (lyr == 0) {
-    string data_dir = todir(input); // distributed stored data
-    auto lines = paracel_load(data_dir);
+void autoencoder::load_input(){
+  string data_dir = todir(input); // distributed stored data
+  auto lines = load_lines(data_dir);
+  if (sample_frac < 1.) {
+    // every worker keeps its own random share of its lines, in order
+    std::mt19937 rng(get_worker_id() + 1);
+    std::bernoulli_distribution keep(sample_frac);
+    size_t n = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+      if (keep(rng)) {
+        lines[n++].swap(lines[i]);
+      }
+    }
+    std::cout << "worker" << get_worker_id() << " keeps " << n << " of " << lines.size() << " lines" << std::endl;
+    lines.resize(n);
+  }
+  // noise of DAE fills every bin in, so corrupted input stays dense
+  double density = sample_density(lines, ' ', true);
+  sparse_input = !corrupt && density < sparse_thld;
+  if (sparse_input) {
+    std::cout << "worker" << get_worker_id() << " input density " << density << ", using sparse input" << std::endl;
+    local_parser_sparse(lines, ' ', true); // includes label
+  } else {
     local_parser(lines, ' ', true); // includes label
-    data = vec_to_mat(samples).transpose();   
+    // a worker may get no lines at all, it still trains with the others
+    data = samples.empty() ? MatrixXd(visible_size, 0) : MatrixXd(vec_to_mat(samples).transpose());
     samples.resize(0);
-    lines.resize(0);
+  }
+  lines.resize(0);
+}
+
+// load once and hand the result to share_input of every model. The
+// density test is that of this model; samples are held out whenever
+// early stopping is on, so every model trains on the same samples
+std::shared_ptr<const ae_input> autoencoder::load_shared_input(){
+  load_input();
+  if (early_stopping()) {
+    holdout_split();
+  }
+  std::shared_ptr<ae_input> in = std::make_shared<ae_input>();
+  in->data.swap(data);
+  in->sdata.swap(sdata);
+  in->sparse = sparse_input;
+  in->hold.swap(hold);
+  sparse_input = false;
+  return in;
+}
+
+void autoencoder::share_input(std::shared_ptr<const ae_input> in){
+  input0 = in;
+}
 
+void autoencoder::train(int lyr){
+  if (lyr == 0 && !input0) {
+    load_input();
+    // held out samples stay clean under DAE
+    if (early_stopping()) {
+      holdout_split();
+    }
     // DAE configuration
     if (corrupt) {
       std::cout << "worker" << get_worker_id() << " Setting for Denoising" << std::endl;
       corrupt_data();
     }
+  } else if (lyr == 0) {
+    sparse_input = input0->sparse;
+    hold = input0->hold;
+    if (corrupt) {
+      // the noise goes into a copy shared by the models of the same noise,
+      // the clean input stays untouched
+      std::cout << "worker" << get_worker_id() << " Setting for Denoising" << std::endl;
+      std::shared_ptr<MatrixXd> & noisy = input0->noisy[std::make_pair(dvt, foc)];
+      if (!noisy) {
+        data = sparse_input ? MatrixXd(input0->sdata) : input0->data;
+        corrupt_data();
+        noisy = std::make_shared<MatrixXd>();
+        noisy->swap(data);
+      }
+      sparse_input = false;
+      in_data = noisy.get();
+    } else {
+      in_data = &input0->data;
+      in_sdata = &input0->sdata;
+    }
   }
-  assert(data.rows() == layer_size[lyr] &&\
+  assert((!codes.empty() ? codes.rows() : sparse_input ? in_sdata->rows() : in_data->rows()) == layer_size[lyr] &&\
       "Modify layers' size in .json file to adjust data's dimension");  // QA
-  if (learning_method == "dbgd") {
+  if (beta != 0 && lyr >= freeze_layers) {
+    rho_init(lyr);
+  }
+  if (lyr < freeze_layers) {
+    std::cout << "worker" << get_worker_id() << " keeps layer " << lyr << " of " << init_model << " frozen" << std::endl;
+  } else if (learning_method == "dbgd") {
     std::cout << "worker" << get_worker_id() << " chose distributed batch gradient descent" << std::endl;
     set_total_iters(rounds); // default value
     distribute_bgd(lyr);
   } else if (learning_method == "dsgd") {
     std::cout << "worker" << get_worker_id() << " chose downpour stochasitc gradient descent" << std::endl;
-    set_total_iters(rounds * ceil(data.cols() / float(update_batch))); // consider update_batch
+    set_total_iters(rounds * ceil(n_samples() / float(update_batch))); // consider update_batch
     downpour_sgd(lyr);
+  } else if (learning_method == "hwdsgd") {
+    std::cout << "worker" << get_worker_id() << " chose hogwild downpour stochastic gradient descent with " << n_threads << " threads" << std::endl;
+    set_total_iters(rounds * ceil(n_samples() / float(n_threads * sync_interval)));
+    downpour_sgd_hogwild(lyr);
   } else if (learning_method == "mbdsgd") {
     std::cout << "worker" << get_worker_id() << " chose mini-batch downpour stochastic gradient descent" << std::endl;
-    int n_mibt = ceil(data.cols() / float(mibt_size));
+    int n_mibt = ceil(n_samples() / float(mibt_size));
     set_total_iters(rounds * ceil(n_mibt / float(update_batch))); // consider update_batch
     downpour_sgd_mibt(lyr);
+  } else if (learning_method == "easgd") {
+    std::cout << "worker" << get_worker_id() << " chose elastic averaging stochastic gradient descent" << std::endl;
+    int n_mibt = ceil(n_samples() / float(mibt_size));
+    set_total_iters(rounds * ceil(n_mibt / float(std::max(easgd_tau, 1))));
+    elastic_sgd_mibt(lyr);
+  } else if (learning_method == "ardbgd") {
+    std::cout << "worker" << get_worker_id() << " chose batch gradient descent over an allreduce ring" << std::endl;
+    allreduce_bgd(lyr);
+  } else if (learning_method == "armbsgd") {
+    std::cout << "worker" << get_worker_id() << " chose synchronous mini-batch stochastic gradient descent over an allreduce ring" << std::endl;
+    allreduce_sgd_mibt(lyr);
   } else {
     std::cout << "worker" << get_worker_id() << " learning method not supported." << std::endl;
     return;
   }
+  if (lyr >= freeze_layers && !allreduce_mode()) {
+    clear_round_keys(lyr);
+  }
   // data for next layer
-  data = acti_func((WgtBias[lyr].at("W1") * data).colwise() + MatrixXd::ColXpr(WgtBias[lyr].at("b1").col(0)));
+  propagate(lyr);
+  if (hold.cols()) {
+    hold = acti_func((WgtBias[lyr].at("W1") * hold).colwise() + MatrixXd::ColXpr(WgtBias[lyr].at("b1").col(0)));
+  }
+  alpha = alpha0;
   // Discard IO operations
   /*
   if (get_worker_id() == 0) {  // delete the previous data file, since it is stored by ios::app
@@ -614,8 +1738,69 @@ void autoencoder::train(int lyr){
 }
 
 
+// The codes f(W1 x + b1) of the current samples become the input of layer
+// lyr+1, either in double or packed into codes. They are built a block of
+// columns at a time, so packing never holds the double matrix in full
+void autoencoder::propagate(int lyr){
+  const MatrixXd & W1 = WgtBias[lyr].at("W1");
+  const MatrixXd & b1 = WgtBias[lyr].at("b1");
+  int n = n_samples(), blk = 1024;
+  bool pack = code_format != "double";
+  // u8 needs the bounded range of sigmoid or tanh
+  code_store::format fmt = code_format == "u8" && acti_func_type != "ReLU" ? code_store::u8 : code_store::bf16;
+  code_store next;
+  MatrixXd out;
+  if (pack) {
+    next.resize(W1.rows(), n, fmt, acti_func_type == "tanh" ? -1. : 0., 1.);
+  } else {
+    out.resize(W1.rows(), n);
+  }
+  MatrixXd x, a;
+  for (int j = 0; j < n; j += blk) {
+    int m = std::min(blk, n - j);
+    if (sparse_input) {
+      a.noalias() = W1 * in_sdata->middleCols(j, m);
+    } else if (codes.empty()) {
+      a.noalias() = W1 * in_data->middleCols(j, m);
+    } else {
+      x.resize(codes.rows(), m);
+      codes.widen_cols(j, x);
+      a.noalias() = W1 * x;
+    }
+    a.colwise() += b1.col(0);
+    acti_apply(a);
+    if (pack) {
+      next.set_cols(j, a);
+    } else {
+      out.middleCols(j, m) = a;
+    }
+  }
+  data.swap(out);
+  codes = std::move(next);
+  sdata.resize(0, 0);
+  sdata.data().squeeze();
+  sparse_input = false;
+  // upper layers train on this model's own codes; the shared input is
+  // freed once the last model has left layer 0
+  in_data = &data;
+  in_sdata = &sdata;
+  input0.reset();
+  if (pack) {
+    std::cout << "worker" << get_worker_id() << " keeps the " << n << " codes of layer " << lyr + 1
+              << " in " << (fmt == code_store::u8 ? "u8" : "bf16") << ", " << codes.bytes() / 1048576.
+              << " MB instead of " << 8. * codes.rows() * n / 1048576. << " MB" << std::endl;
+  }
+}
+
+
 void autoencoder::train(){
   // top function
+  // only when a layer is left to pretrain, fine-tuning falls back to
+  // mbdsgd for hwdsgd
+  if (learning_method == "hwdsgd" && dropout > 0 && freeze_layers < n_lyr) {
+    std::cerr << "dropout is not supported by hwdsgd, set dropout to 0 or choose another learning method" << std::endl;
+    exit(-1);
+  }
   for (int i = 0; i < n_lyr; i++) {
     std::cout << "worker" << get_worker_id() << " starts training layer " << i+1 << std::endl;
     train(i);
@@ -628,6 +1813,56 @@ void autoencoder::train(){
 }
 
 
+vector<string> autoencoder::load_lines(const string & dir) {
+  return byte_shard ? shard_load(dir) : paracel_load(dir);
+}
+
+// lines of the files in dir whose first byte falls into this worker's
+// equal share of the total bytes; files are taken in name order
+vector<string> autoencoder::shard_load(const string & dir) {
+  vector<boost::filesystem::path> files;
+  for (boost::filesystem::directory_iterator it(dir), end; it != end; ++it) {
+    if (boost::filesystem::is_regular_file(it->path()) &&
+        it->path().filename().string()[0] != '.') {
+      files.push_back(it->path());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  uintmax_t total = 0;
+  for (auto & f : files) {
+    total += boost::filesystem::file_size(f);
+  }
+  uintmax_t lo = total * get_worker_id() / get_worker_size();
+  uintmax_t hi = total * (get_worker_id() + 1) / get_worker_size();
+
+  vector<string> lines;
+  uintmax_t base = 0;
+  for (auto & f : files) {
+    uintmax_t sz = boost::filesystem::file_size(f);
+    if (base + sz > lo && base < hi) {
+      std::ifstream is(f.string());
+      string line;
+      uintmax_t pos = lo > base ? lo - base : 0;
+      if (pos > 0) {
+        // a line cut by lo belongs to the previous worker
+        is.seekg(pos - 1);
+        std::getline(is, line);
+        pos = is ? uintmax_t(is.tellg()) : sz;
+      }
+      while (base + pos < hi && std::getline(is, line)) {
+        pos += line.size() + 1;
+        if (!line.empty()) {
+          lines.push_back(line);
+        }
+      }
+    }
+    base += sz;
+  }
+  std::cout << "worker" << get_worker_id() << " loaded bytes [" << lo << ", " << hi << "), " << lines.size() << " lines" << std::endl;
+  return lines;
+}
+
+
 void autoencoder::local_parser(const vector<string> & linelst, const char sep, bool spv){
   samples.resize(0);
   labels.resize(0);
@@ -657,6 +1892,119 @@ void autoencoder::local_parser(const vector<string> & linelst, const char sep, b
   }
 }
 
+// fraction of non-zero features over (at most) the first 1000 lines
+double autoencoder::sample_density(const vector<string> & linelst, const char sep, bool spv) const {
+  size_t nnz = 0, total = 0;
+  size_t n = std::min(linelst.size(), (size_t)1000);
+  for (size_t k = 0; k < n; k++) {
+    auto linev = paracel::str_split(linelst[k], sep);
+    size_t dim = spv ? linev.size() - 1 : linev.size();
+    for (size_t i = 0; i < dim; i++) {
+      if (std::stod(linev[i]) != 0) { nnz += 1; }
+    }
+    total += dim;
+  }
+  return total ? nnz / double(total) : 1.;
+}
+
+
+// parse straight into CSC storage, one column per sample
+void autoencoder::local_parser_sparse(const vector<string> & linelst, const char sep, bool spv){
+  vector<Eigen::Triplet<double> > trips;
+  samples.resize(0);
+  labels.resize(0);
+  int col = 0;
+  for (auto & line: linelst) {
+    auto linev = paracel::str_split(line, sep);
+    size_t dim = spv ? linev.size() - 1 : linev.size();
+    assert((int)dim == visible_size);
+    for (size_t i = 0; i < dim; i++) {
+      double v = std::stod(linev[i]);
+      if (v != 0) {
+        trips.push_back(Eigen::Triplet<double>(i, col, v));
+      }
+    }
+    if (spv) {
+      labels.push_back(std::stod(linev.back()));
+    }
+    col += 1;
+  }
+  sdata.resize(visible_size, col);
+  sdata.setFromTriplets(trips.begin(), trips.end());
+  sdata.makeCompressed();
+  data.resize(0, 0);
+}
+
+
+int autoencoder::n_samples() const {
+  if (!codes.empty()) {
+    return codes.cols();
+  }
+  return sparse_input ? in_sdata->cols() : in_data->cols();
+}
+
+// x_i of dense input, widened into ws when the codes are packed
+Eigen::Map<const VectorXd> autoencoder::sample_col(int i, workspace & ws) const {
+  if (codes.empty()) {
+    return Eigen::Map<const VectorXd>(in_data->col(i).data(), in_data->rows());
+  }
+  workspace::vec_t x = ws.vec(codes.rows());
+  codes.widen_col(i, x.data());
+  return Eigen::Map<const VectorXd>(x.data(), x.size());
+}
+
+// v -= x_i
+void autoencoder::sample_sub(Eigen::Ref<VectorXd> v, int i) const {
+  if (sparse_input) {
+    for (Eigen::SparseMatrix<double>::InnerIterator it(*in_sdata, i); it; ++it) {
+      v(it.index()) -= it.value();
+    }
+  } else {
+    workspace & ws = scratch();
+    workspace::frame fr(ws);
+    v -= sample_col(i, ws);
+  }
+}
+
+// out = W * x_i, a sum over the non-zero columns of W for sparse input
+void autoencoder::sample_prod(Eigen::Ref<VectorXd> out, const MatrixXd & W, int i) const {
+  if (sparse_input) {
+    out.setZero();
+    for (Eigen::SparseMatrix<double>::InnerIterator it(*in_sdata, i); it; ++it) {
+      out += it.value() * W.col(it.index());
+    }
+  } else {
+    workspace & ws = scratch();
+    workspace::frame fr(ws);
+    out.noalias() = W * sample_col(i, ws);
+  }
+}
+
+// G += scale * s * x_i^T; only the non-zero columns are touched for sparse input
+void autoencoder::sample_outer(Eigen::Ref<MatrixXd> G, const Eigen::Ref<const VectorXd> & s, int i, double scale) const {
+  if (sparse_input) {
+    for (Eigen::SparseMatrix<double>::InnerIterator it(*in_sdata, i); it; ++it) {
+      G.col(it.index()) += (scale * it.value()) * s;
+    }
+  } else {
+    workspace & ws = scratch();
+    workspace::frame fr(ws);
+    G.noalias() += scale * s * sample_col(i, ws).transpose();
+  }
+}
+
+
+// buffered variant, sparse samples still go straight into the target
+void autoencoder::sample_outer(outer_acc & acc, const Eigen::Ref<const VectorXd> & s, int i) const {
+  if (sparse_input) {
+    sample_outer(acc.target(), s, i);
+  } else {
+    workspace & ws = scratch();
+    workspace::frame fr(ws);
+    acc.add(s, sample_col(i, ws));
+  }
+}
+
 void autoencoder::local_dump_Mat(const MatrixXd & m, const string filename, const char sep){
   std::ofstream os;
   os.open(filename, std::ofstream::app);
@@ -670,7 +2018,7 @@ void autoencoder::local_dump_Mat(const MatrixXd & m, const string filename, cons
 }
 
 
-inline MatrixXd autoencoder::vec_to_mat(const vector< vector<double> > & v) {
+MatrixXd autoencoder::vec_to_mat(const vector< vector<double> > & v) {
   MatrixXd m(v.size(), v[0].size());
   for (size_t i = 0; i < v.size(); i++) {
     m.row(i) = VectorXd::Map(&v[i][0], v[i].size());  // row ordered
@@ -707,21 +2055,107 @@ inline vector<double> autoencoder::Mat_to_vec(const MatrixXd & m){
 
 
 inline void autoencoder::_paracel_write(string key, MatrixXd & m){
-  paracel_write(key, Mat_to_vec(m));
+  paracel_write(key_prefix + key, Mat_to_vec(m));
 }
 
 inline MatrixXd autoencoder::_paracel_read(string key, int r, int c){
-  vector<double> v = paracel_read<vector<double> >(key);
+  vector<double> v = paracel_read<vector<double> >(key_prefix + key);
   return vec_to_mat(v, r, c);
 }
 
 inline VectorXd autoencoder::_paracel_read(string key){
-  vector<double> v = paracel_read<vector<double> >(key);
+  vector<double> v = paracel_read<vector<double> >(key_prefix + key);
   return vec_to_mat(v);
 }
 
 inline void autoencoder::_paracel_bupdate(string key, MatrixXd & m){
-  paracel_bupdate(key, Mat_to_vec(m));
+  paracel_bupdate(key_prefix + key, Mat_to_vec(m));
+}
+
+
+// Every matrix is cut into row blocks, one per server, and block s is
+// stored under a key that paralg's hash ring places on server s. Small
+// matrices are never cut thinner than a row.
+inline int autoencoder::n_shard(const MatrixXd & m) const {
+  return std::max(1, std::min(n_srv, (int)m.rows()));
+}
+
+// key of block s: the first of key_<s>, key_<s>_1, key_<s>_2, ... that the
+// ring, built like paralg's over server ids 0 .. n_srv - 1, maps to server
+// s % n_srv. Every worker finds the same name; should the ring differ from
+// paralg's, the blocks are merely placed by hash again
+const string & autoencoder::shard_key(const string & key, int s){
+  string base = key_prefix + key + "_" + std::to_string(s);
+  auto it = shard_keys.find(base);
+  if (it != shard_keys.end()) {
+    return it->second;
+  }
+  string name = base;
+  for (int salt = 1; srv_ring->get_server(name) != s % n_srv && salt < 64 * n_srv; salt++) {
+    name = base + "_" + std::to_string(salt);
+  }
+  return shard_keys[base] = name;
+}
+
+void autoencoder::_paracel_write_shard(string key, const MatrixXd & m){
+  int n = n_shard(m);
+  for (int s = 0; s < n; s++) {
+    int r_st = s * m.rows() / n, r_en = (s + 1) * m.rows() / n;
+    MatrixXd blk = m.middleRows(r_st, r_en - r_st);
+    paracel_write(shard_key(key, s), Mat_to_vec(blk));
+  }
+}
+
+void autoencoder::_paracel_read_shard(string key, MatrixXd & m){
+  int n = n_shard(m);
+  for (int s = 0; s < n; s++) {
+    int r_st = s * m.rows() / n, r_en = (s + 1) * m.rows() / n;
+    vector<double> v = paracel_read<vector<double> >(shard_key(key, s));
+    assert((int)v.size() == (r_en - r_st) * m.cols());
+    // reassemble in place, no full-size temporary
+    m.middleRows(r_st, r_en - r_st) = MatrixXd::Map(&v[0], r_en - r_st, m.cols());
+  }
+}
+
+void autoencoder::_paracel_bupdate_shard(string key, const MatrixXd & m){
+  int n = n_shard(m);
+  for (int s = 0; s < n; s++) {
+    int r_st = s * m.rows() / n, r_en = (s + 1) * m.rows() / n;
+    MatrixXd blk = m.middleRows(r_st, r_en - r_st);
+    paracel_bupdate(shard_key(key, s), Mat_to_vec(blk));
+  }
+}
+
+void autoencoder::_paracel_write_lyr(int lyr){
+  for (auto & kv : WgtBias[lyr]) {
+    _paracel_write_shard(kv.first, kv.second);
+  }
+  if (beta != 0 && rho_ps) {
+    _paracel_write_shard("rho", rho_est[lyr]);
+  }
+}
+
+void autoencoder::_paracel_read_lyr(int lyr){
+  for (auto & kv : WgtBias[lyr]) {
+    _paracel_read_shard(kv.first, kv.second);
+  }
+  if (beta != 0 && rho_ps) {
+    _paracel_read_shard("rho", rho_est[lyr]);
+    rho_pulled = rho_est[lyr];
+  }
+}
+
+// the server keeps rho as the average of the workers' estimates: each
+// push adds this worker's drift since its last pull, over the worker count
+void autoencoder::_paracel_bupdate_lyr(int lyr, const unordered_map<string, MatrixXd> & delta){
+  for (auto & kv : delta) {
+    _paracel_bupdate_shard(kv.first, kv.second);
+  }
+  if (beta != 0 && rho_ps) {
+    MatrixXd rho_delta = (rho_est[lyr] - rho_pulled) / get_worker_size();
+    _paracel_bupdate_shard("rho", rho_delta);
+    rho_pulled = rho_est[lyr];
+  }
 }
 
 
@@ -741,7 +2175,9 @@ void autoencoder::dump_mat(const MatrixXd & m, const string filename) const {
 void autoencoder::dump_result(int lyr) const {
   MatrixXd tmp;
   dump_mat(WgtBias[lyr].at("W1"), (todir(output) + "ae_layer_" + std::to_string(lyr) + "_W1"));
-  dump_mat(WgtBias[lyr].at("W2"), (todir(output) + "ae_layer_" + std::to_string(lyr) + "_W2"));
+  // tied layers still dump W2 so that readers find four files per layer
+  dump_mat(tied ? MatrixXd(WgtBias[lyr].at("W1").transpose()) : WgtBias[lyr].at("W2"),
+           (todir(output) + "ae_layer_" + std::to_string(lyr) + "_W2"));
   dump_mat(WgtBias[lyr].at("b1"), (todir(output) + "ae_layer_" + std::to_string(lyr) + "_b1"));
   dump_mat(WgtBias[lyr].at("b2"), (todir(output) + "ae_layer_" + std::to_string(lyr) + "_b2"));
   }
@@ -4,11 +4,23 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <map>
 #include <cstdlib>
+#include <cstdint>
 #include <fstream>
+#include <memory>
 #include <eigen3/Eigen/Dense>
+#include <eigen3/Eigen/Sparse>
 #include "ps.hpp"
+#include "ring.hpp"
 #include "utils.hpp"
+#include "ae_kernel.hpp"
+#include "ae_ring.hpp"
+
+// bupdate library loaded by the servers, the build points it at its ae_update
+#ifndef AE_UPDATE_LIB
+#define AE_UPDATE_LIB "libae_update.so"
+#endif
 
 using namespace std;
 using Eigen::MatrixXd;
@@ -17,36 +29,193 @@ using Eigen::VectorXd;
 
 namespace paracel{
 
+// layer 0 input as loaded and split by one worker, shared read-only by
+// the models of a sweep. Denoising models with the same deviation and
+// fraction of corrupted samples share one dense noisy copy, made by the
+// first of them to train
+struct ae_input {
+  MatrixXd data;
+  Eigen::SparseMatrix<double> sdata;
+  bool sparse = false;
+  MatrixXd hold;
+  mutable std::map<std::pair<double, double>, std::shared_ptr<MatrixXd> > noisy;  // (dvt, foc) -> corrupted data
+};
+
+// everything a solver is configured with, one field per key of the json
+// config; the defaults are those of a key missing from it
+struct ae_options {
+  string input;   // where you store data over layers
+  string output;  // where you dump out results
+  vector<int> hidden_size;
+  int visible_size = 0;
+  string learning_method = "mbdsgd";
+  string acti_func_type = "sigmoid";
+  int rounds = 1;
+  double alpha = 0.01;
+  bool debug = false;
+  int limit_s = 0;
+  bool ssp_switch = false;
+  double lamb = 0.001;
+  double sparsity_param = 0.0001;
+  double beta = 3.;
+  int mibt_size = 1;
+  int read_batch = 0;
+  int update_batch = 0;
+  bool corrupt = false;
+  double dvt = 0.3;
+  double foc = 0.1;
+  int n_threads = 1;
+  int sync_interval = 1000;
+  double sparse_thld = 0.3;
+  double rho_decay = 0.99;
+  bool rho_ps = false;
+  bool tied = false;
+  double dropout = 0.;
+  bool byte_shard = false;
+  bool rebalance = false;
+  double round_budget = 0.;
+  string lr_schedule = "const";
+  double lr_decay = 0.5;
+  int lr_step = 10;
+  double lr_min = 0.;
+  double holdout = 0.;
+  int patience = 0;
+  double min_delta = 0.001;
+  bool pin_threads = false;
+  string key_prefix;
+  string code_format = "double";
+  int ar_chunk = 65536;
+  int easgd_tau = 64;
+  double easgd_beta = 0.9;
+  string init_model;
+  int warm_rounds = 0;
+  int freeze_layers = 0;
+  double sample_frac = 1.;
+  string update_lib;  // empty means AE_UPDATE_LIB
+  bool servers = true;  // connect to the paracel servers, only the allreduce methods run without
+};
+
+// methods that exchange over MPI instead of through the servers
+inline bool allreduce_method(const string & method) {
+  return method == "ardbgd" || method == "armbsgd";
+}
+
 class autoencoder: public paracel::paralg{
 
  public:
-  autoencoder(paracel::Comm, string, string, string, vector<int>, int, string = "sgd", string = "sigmoid", int = 1, double = 0.01, bool = false, int = 0, bool = false, double = 0.001, double = 0.0001, double = 3., int = 1, int = 0, int = 0, bool = false, double = 0.30, double = 0.1); // TO BE COMPLETED
+  // a pretrained stack, if given, replaces the random initial weights
+  autoencoder(paracel::Comm, string, const ae_options &,
+              const vector<unordered_map<string, MatrixXd> > & = vector<unordered_map<string, MatrixXd> >());
   virtual ~autoencoder();
 
   void downpour_sgd(int); // downpour stochastic gradient descent
   void distribute_bgd(int);          // conventional batch-gradient descent
   void downpour_sgd_mibt(int); // downpour stochastic gradient descent and mini-batch involved
+  void downpour_sgd_hogwild(int); // lock-free multi-threaded downpour sgd on shared weights
+  void allreduce_bgd(int);  // batch gradient descent summed over an MPI ring, no server traffic
+  void allreduce_sgd_mibt(int);  // synchronous mini-batch sgd over an MPI ring
+  void elastic_sgd_mibt(int);  // local mini-batch sgd pulled towards a center on the servers
   
   void local_parser(const vector<string> &, const char = ',', bool = false);
+  void local_parser_sparse(const vector<string> &, const char = ',', bool = false);
+  double sample_density(const vector<string> &, const char = ',', bool = false) const;
   void local_dump_Mat(const MatrixXd &, const string filename, const char = ',');
   void train(int);
   void train(); // top function
+  void load_input();  // layer 0 input of this worker into data or sdata
+  std::shared_ptr<const ae_input> load_shared_input();
+  void share_input(std::shared_ptr<const ae_input>);  // train layer 0 on a loaded input
+  void propagate(int);  // codes of layer lyr as the input of the next one
   void dump_mat(const MatrixXd &, const string) const;
   void dump_result(int) const;
   MatrixXd acti_func(const MatrixXd &) const;
   ArrayXXd acti_func_der(const MatrixXd &) const;
+  void acti_apply(Eigen::Ref<MatrixXd>) const;  // f in place
+  void acti_der_mul(Eigen::Ref<MatrixXd>, const Eigen::Ref<const MatrixXd> &) const;  // s *= f'(a)
   vector<unordered_map<string, MatrixXd> > GetWgtBias() const;
 
   // init
   void ae_init(void);
+  int load_model(const string &);  // layers of a dumped model into WgtBias, returns how many
   // compute cost function
   double ae_cost(int) const;
   // back-propogation batch gradient compute
   unordered_map<string, MatrixXd> ae_batch_grad(int) const;
-  // back-propogation stochastic gradient compute
-  unordered_map<string, MatrixXd> ae_stoc_grad(int, int) const;
+  // back-propogation stochastic gradient compute, into the entries of grad
+  void ae_stoc_grad(int, int, unordered_map<string, MatrixXd> &);
   // BP with Mini-batch
-  unordered_map<string, MatrixXd> ae_mibt_stoc_grad(int, vector<int>) const;
+  void ae_mibt_stoc_grad(int, const vector<int> &, unordered_map<string, MatrixXd> &);
+  // BP of one sample applied in place to WgtBias and delta, for Hogwild;
+  // the last argument is the running rho of the calling thread
+  void ae_stoc_update(int, int, double, unordered_map<string, MatrixXd> &, MatrixXd &);
+  void hogwild_decay(int, double, int, unordered_map<string, MatrixXd> &);
+  // W -= alpha * grad, with the step accumulated into delta
+  void apply_step(int, unordered_map<string, MatrixXd> &, unordered_map<string, MatrixXd> &);
+  void zero_delta(unordered_map<string, MatrixXd> &) const;
+
+  // input samples of the current layer, dense or sparse
+  int n_samples() const;
+  Eigen::Map<const VectorXd> sample_col(int, workspace &) const;  // dense x_i
+  void sample_sub(Eigen::Ref<VectorXd>, int) const;
+  void sample_prod(Eigen::Ref<VectorXd>, const MatrixXd &, int) const;
+  void sample_outer(Eigen::Ref<MatrixXd>, const Eigen::Ref<const VectorXd> &, int, double = 1.) const;
+  void sample_outer(outer_acc &, const Eigen::Ref<const VectorXd> &, int) const;
+
+  // per-thread workspace of the per-sample temporaries below
+  workspace & scratch() const;
+  size_t scratch_size(int) const;
+  // forward and backward pass of one sample
+  void encode(int, int, Eigen::Ref<VectorXd>) const;
+  void decode(int, const Eigen::Ref<const VectorXd> &, Eigen::Ref<VectorXd>) const;
+  void backprop(int, int, const Eigen::Ref<const VectorXd> &, const Eigen::Ref<const VectorXd> &,
+                const Eigen::Ref<const VectorXd> &, Eigen::Ref<VectorXd>, Eigen::Ref<VectorXd>) const;
+
+  // decoder of a layer, W2 or the transpose of W1 when tied
+  void dec_prod(int, const Eigen::Ref<const VectorXd> &, Eigen::Ref<VectorXd>) const;
+  void dec_tprod(int, const Eigen::Ref<const VectorXd> &, Eigen::Ref<VectorXd>) const;
+  void dec_outer(outer_acc &, outer_acc &, const Eigen::Ref<const VectorXd> &, const Eigen::Ref<const VectorXd> &) const;
+  double wgt_sqnorm(int) const;
+  double w1_lamb() const;
+
+  // dropout on hidden units, masks are bit-packed 64 units per word
+  int drop_words(int n) const { return (n + 63) / 64; }
+  double drop_keep() const;
+  void drop_mask(int, uint64_t *) const;
+  void drop_acti(Eigen::Ref<VectorXd>, uint64_t *, vector<int> &) const;
+  void drop_apply(Eigen::Ref<VectorXd>, const uint64_t *) const;
+  void drop_forward(int, int, vector<int> &, Eigen::Ref<VectorXd>) const;
+  void drop_backward(int, int, const vector<int> &, const Eigen::Ref<const VectorXd> &,
+                     const Eigen::Ref<const VectorXd> &, Eigen::Ref<MatrixXd>, Eigen::Ref<MatrixXd>,
+                     Eigen::Ref<VectorXd>, Eigen::Ref<VectorXd>) const;
+  void drop_outer(Eigen::Ref<MatrixXd>, const vector<int> &, const Eigen::Ref<const VectorXd> &, int) const;
+
+  // work split over workers
+  vector<string> load_lines(const string &);
+  vector<string> shard_load(const string &);
+  vector<int> round_order(vector<int> &, int) const;
+  vector<vector<int>> mibt_split(const vector<int> &) const;
+  int round_quota(int, int, double);
+  string round_key(const string &, int, int, int) const;
+  void clear_round_keys(int);
+
+  // synchronous exchange among the workers over MPI, without servers
+  bool allreduce_mode() const;
+  void allreduce_sum(unordered_map<string, MatrixXd> &);  // in place, over all workers
+  void bcast_lyr(int);  // weights of worker 0 to all
+
+  // per-layer convergence: step size schedule and early stopping on the
+  // reconstruction cost of held out samples
+  double lr_at(int) const;
+  bool early_stopping() const;
+  void holdout_split();
+  double holdout_cost(int) const;
+  virtual bool converged(int, int);
+
+  // sparse penalty with a running estimate of rho
+  void kl_sigma(const Eigen::Ref<const MatrixXd> &, Eigen::Ref<VectorXd>) const;
+  void rho_update(int, const Eigen::Ref<const VectorXd> &);
+  void rho_update(MatrixXd &, const Eigen::Ref<const VectorXd> &) const;
+  void rho_init(int);
 
   // for DAE
   void corrupt_data();
@@ -57,6 +226,16 @@ class autoencoder: public paracel::paralg{
   VectorXd _paracel_read(string key);
   void _paracel_bupdate(string key, MatrixXd & m);
 
+  // row-block sharded layout of a layer over all paracel servers
+  int n_shard(const MatrixXd &) const;
+  const string & shard_key(const string & key, int s);  // key of block s, held by server s
+  void _paracel_write_shard(string key, const MatrixXd & m);
+  void _paracel_read_shard(string key, MatrixXd & m);  // reassemble in place
+  void _paracel_bupdate_shard(string key, const MatrixXd & m);
+  void _paracel_write_lyr(int lyr);
+  void _paracel_read_lyr(int lyr);
+  void _paracel_bupdate_lyr(int lyr, const unordered_map<string, MatrixXd> & delta);
+
   // IT SHOULD BE CLASS-INVARIANT!!!
   // conversion between Eigen::MatrixXd and std::vector
   MatrixXd vec_to_mat(const vector<vector<double> > &); // row ordered
@@ -71,26 +250,73 @@ class autoencoder: public paracel::paralg{
 
  protected:
   int worker_id;
+  int n_srv;  // number of paracel servers in server_info
+  std::unique_ptr<paracel::ring<int> > srv_ring;  // key placement of paralg, over server ids
+  unordered_map<string, string> shard_keys;       // key_<s> -> key of block s on server s
   int rounds;
   int n_lyr;  // number of hidden layers
   int mibt_size;
   int read_batch;
   int update_batch;
+  int n_threads;      // hogwild threads per worker
+  int sync_interval;  // samples per hogwild thread between server exchanges
   string learning_method;
   string acti_func_type;
   bool debug = false;
+  bool byte_shard;      // split input files by byte ranges instead of paracel_load
+  bool rebalance;       // size rounds by the measured samples/sec of each worker
+  double round_budget;  // seconds per round, 0 means a full pass
+  double straggler_ratio = 0.8;  // reported below this fraction of the median rate
+  bool pin_threads;     // pin every hogwild thread to one of the rank's cpus
+  paracel::Comm ar_comm;  // workers of the allreduce trainers
+  int ar_chunk;           // doubles per message of the ring
+  vector<double> ar_buf;  // flat gradient of a layer
+  int easgd_tau;          // local mini-batch steps between elastic exchanges
+  double easgd_beta;      // move of the center per exchange, as a fraction of the mean difference
   vector<double> loss_error;
   vector<unordered_map<string, MatrixXd> > WgtBias;
   MatrixXd data;
+  Eigen::SparseMatrix<double> sdata;  // CSC input of layer 0 if sparse_input
+  bool sparse_input = false;
+  std::shared_ptr<const ae_input> input0;  // shared layer 0 input, if any
+  const MatrixXd * in_data = &data;  // samples of the current layer, data or input0
+  const Eigen::SparseMatrix<double> * in_sdata = &sdata;
+  string code_format;  // double, bf16 or u8 storage of the input of layers above 0
+  code_store codes;    // that input unless code_format is double
+  double sparse_thld;  // density below which layer 0 input is kept sparse
   vector< vector<double> > samples;
   vector<int> labels; // if necessary
   double lamb;            // weight decay
   double sparsity_param;    // sparse KL comparison
   double beta;              // sparse penalty
+  double rho_decay;         // decay of the running average of rho
+  bool rho_ps;              // average rho over workers through the servers
+  vector<MatrixXd> rho_est; // running rho per layer
+  MatrixXd rho_pulled;      // rho_est at the last exchange with the servers
   double alpha;             // learning step size
+  double alpha0;            // step size of the first round of a layer
+  string lr_schedule;       // const, step, exp or cosine decay of alpha over the rounds of a layer
+  double lr_decay;          // factor of step and exp decay
+  int lr_step;              // rounds per step of step decay
+  double lr_min;            // alpha of the last round of cosine decay
+  double holdout;           // fraction of the local samples kept out of training
+  int patience;             // rounds without improvement of the holdout cost before a layer stops, 0 never stops
+  double min_delta;         // relative decrease of the holdout cost counted as improvement
+  MatrixXd hold;            // held out samples of the current layer, one per column
+  double best_hold;         // lowest holdout cost of the current layer
+  double last_hold;         // holdout cost of the last round
+  int n_stale;              // rounds since best_hold improved
   vector<int> hidden_size;
   int visible_size;
   vector<int> layer_size;  // combine hidden_size and layer_size together
+  bool tied;  // W2 = W1^T, no "W2" in WgtBias
+  double dropout;  // probability of dropping a hidden unit while training
+  size_t ws_size;  // doubles of scratch() needed by the largest layer
+  string key_prefix;  // namespace of every server key of this model
+  string init_model;   // output directory of a previous run to start from, empty starts from random weights
+  int freeze_layers;   // lower layers of init_model kept as loaded, the input is only propagated through them
+  double sample_frac;  // fraction of the loaded lines kept
+  string update_lib;   // path of libae_update.so as seen by the servers
 
   // for DAE
  private:
@@ -0,0 +1,354 @@
+// End-to-end training throughput on a reproducible workload, to compare
+// builds. The samples are MNIST, read from its IDX files, or synthetic
+// spectrogram patches of 513 bins like those of spec_patch. Rank 0 writes
+// them once as text shards into --workdir, then every method of --methods
+// trains the whole stack layer by layer on them. Per layer it reports
+// samples/sec over all workers, the rounds run, and the seconds until the
+// holdout cost reached --target (a layer stops there). Per method it
+// reports the peak RSS of the worker ranks. Timing covers train(lyr)
+// including the holdout cost of every round and the propagation to the
+// next layer; loading is timed apart.
+//   mpirun -np 4 ae_bench --server_info ... --data mnist --mnist_dir <dir>
+//   mpirun -np 4 ae_bench --server_info ... --data synthetic --samples 20000
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+#include <mpi.h>
+#include <google/gflags.h>
+#include <boost/filesystem.hpp>
+
+#include "ae.hpp"
+
+DEFINE_string(server_info, "host1:7777PARACELhost2:8888", "hosts name string of paracel-servers.\n");
+
+DEFINE_string(data, "synthetic", "mnist or synthetic.\n");
+
+DEFINE_string(mnist_dir, "", "directory of train-images-idx3-ubyte and train-labels-idx1-ubyte.\n");
+
+DEFINE_int32(samples, 20000, "samples, 0 takes every MNIST image.\n");
+
+DEFINE_string(workdir, "ae_bench_data", "where the text shards are written.\n");
+
+DEFINE_string(methods, "dbgd,dsgd,mbdsgd", "comma separated learning methods.\n");
+
+DEFINE_string(hidden, "200,100", "comma separated hidden sizes.\n");
+
+DEFINE_int32(rounds, 10, "rounds per layer.\n");
+
+DEFINE_double(alpha, 0.01, "learning rate.\n");
+
+DEFINE_int32(mibt_size, 16, "mini-batch size.\n");
+
+DEFINE_int32(read_batch, 100, "pull every read_batch steps of dsgd and mbdsgd.\n");
+
+DEFINE_int32(update_batch, 100, "push every update_batch steps of dsgd and mbdsgd.\n");
+
+DEFINE_double(holdout, 0.05, "fraction of the samples whose cost is measured every round.\n");
+
+DEFINE_string(target, "", "comma separated holdout cost per layer at which the layer stops, empty for none.\n");
+
+DEFINE_int32(seed, 1, "seed of the synthetic data.\n");
+
+DEFINE_string(update_lib, "", "libae_update.so as seen by the servers, empty for the one of this build.\n");
+
+typedef std::chrono::steady_clock clk;
+
+static double seconds_since(clk::time_point t0) {
+  return std::chrono::duration<double>(clk::now() - t0).count();
+}
+
+template <class T>
+static vector<T> split_list(const string & s) {
+  vector<T> v;
+  std::stringstream ss(s);
+  string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty()) continue;
+    std::stringstream is(item);
+    T x;
+    is >> x;
+    v.push_back(x);
+  }
+  return v;
+}
+
+// IDX file: big-endian magic (2051 images, 2049 labels), the sizes of its
+// dimensions, then unsigned bytes
+static bool read_idx(const string & path, vector<uint32_t> & dims, vector<unsigned char> & bytes) {
+  std::ifstream is(path, std::ios::binary);
+  auto rd_u32 = [&] () {
+    unsigned char b[4] = {0, 0, 0, 0};
+    is.read(reinterpret_cast<char *>(b), 4);
+    return uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 | b[3];
+  };
+  uint32_t magic = rd_u32();
+  if (!is || (magic >> 8) != 0x08) {  // unsigned byte data
+    return false;
+  }
+  dims.resize(magic & 0xff);
+  size_t n = 1;
+  for (auto & d : dims) {
+    d = rd_u32();
+    n *= d;
+  }
+  bytes.resize(n);
+  is.read(reinterpret_cast<char *>(bytes.data()), n);
+  return bool(is);
+}
+
+// images scaled into [0, 1], one per column
+static bool load_mnist(MatrixXd & x, vector<int> & labels) {
+  vector<uint32_t> dims, ldims;
+  vector<unsigned char> img, lbl;
+  string dir = paracel::todir(FLAGS_mnist_dir);
+  if (!read_idx(dir + "train-images-idx3-ubyte", dims, img) || dims.size() != 3) {
+    std::cerr << "can not read " << dir << "train-images-idx3-ubyte" << std::endl;
+    return false;
+  }
+  int n = dims[0], d = dims[1] * dims[2];
+  if (FLAGS_samples > 0) {
+    n = std::min(n, FLAGS_samples);
+  }
+  bool has_lbl = read_idx(dir + "train-labels-idx1-ubyte", ldims, lbl) && ldims.size() == 1 && (int)ldims[0] >= n;
+  x.resize(d, n);
+  labels.assign(n, 0);
+  for (int k = 0; k < n; k++) {
+    for (int i = 0; i < d; i++) {
+      x(i, k) = img[size_t(k) * d + i] / 255.;
+    }
+    if (has_lbl) {
+      labels[k] = lbl[k];
+    }
+  }
+  return true;
+}
+
+// Power spectra of harmonic sounds: a random fundamental with 1/h decaying
+// harmonics of Gaussian width under a falling envelope, over a noise floor.
+// As in spec_patch they go through log(x + 1) and every bin is clipped at 3
+// deviations and mapped into [0.1, 0.9]
+static void synth_spectra(MatrixXd & x, vector<int> & labels) {
+  const int dim = 513;
+  int n = FLAGS_samples > 0 ? FLAGS_samples : 20000;
+  std::mt19937 rng(FLAGS_seed);
+  std::uniform_real_distribution<double> f0_dist(4., 60.), loud_dist(0.5, 4.);
+  std::normal_distribution<double> noise(0., 1.);
+  x.resize(dim, n);
+  labels.assign(n, 0);
+  for (int k = 0; k < n; k++) {
+    double f0 = f0_dist(rng), loud = loud_dist(rng);
+    for (int i = 0; i < dim; i++) {
+      x(i, k) = 0.05 * std::abs(noise(rng));
+    }
+    for (int h = 1; h * f0 < dim; h++) {
+      double c = h * f0, a = loud / h / (1. + c / 64.);
+      for (int i = std::max(0, int(c - 5)); i < std::min(dim, int(c + 6)); i++) {
+        x(i, k) += a * std::exp(-(i - c) * (i - c) / 4.5);
+      }
+    }
+    labels[k] = std::min(9, int(f0 / 6.));
+  }
+  x = (x.array() + 1.).log();
+  VectorXd mu = x.rowwise().mean();
+  VectorXd sd = ((x.colwise() - mu).array().square().rowwise().sum() / n).sqrt().max(1e-12);
+  for (int k = 0; k < n; k++) {
+    x.col(k) = (((x.col(k) - mu).array() / sd.array()).min(3.).max(-3.) / 3. + 1.) * 0.4 + 0.1;
+  }
+}
+
+// one part_<w> file per worker, in the trainer's text format
+static void write_shards(const MatrixXd & x, const vector<int> & labels, int n_parts) {
+  boost::filesystem::remove_all(FLAGS_workdir);
+  boost::filesystem::create_directories(FLAGS_workdir);
+  char num[32];
+  for (int w = 0; w < n_parts; w++) {
+    std::ofstream os(paracel::todir(FLAGS_workdir) + "part_" + std::to_string(w));
+    string buf;
+    for (long k = (long)x.cols() * w / n_parts; k < (long)x.cols() * (w + 1) / n_parts; k++) {
+      buf.clear();
+      for (int i = 0; i < x.rows(); i++) {
+        int len = std::snprintf(num, sizeof(num), "%.4g ", x(i, k));
+        buf.append(num, len);
+      }
+      buf += std::to_string(labels[k]);
+      buf += '\n';
+      os.write(buf.data(), buf.size());
+    }
+  }
+}
+
+// VmHWM of /proc/self/status in kB; writing 5 to clear_refs resets it
+static long peak_rss_kb() {
+  std::ifstream is("/proc/self/status");
+  string line;
+  while (std::getline(is, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::stol(line.substr(6));
+    }
+  }
+  return 0;
+}
+
+static void reset_peak_rss() {
+  std::ofstream os("/proc/self/clear_refs");
+  os << "5";
+}
+
+namespace paracel {
+
+struct layer_stat {
+  int rounds;
+  double seconds;
+  double t_target;  // seconds until the target holdout cost, < 0 if never
+  double cost;      // holdout cost of the last round
+};
+
+class bench_probe : public autoencoder {
+ public:
+  using autoencoder::autoencoder;
+
+  // load, then train every layer; returns the load seconds and the
+  // samples of all workers
+  vector<layer_stat> run(const vector<double> & target, double & t_load, double & n_total) {
+    auto t = clk::now();
+    std::shared_ptr<const ae_input> in = load_shared_input();
+    share_input(in);
+    double n_local = in->sparse ? in->sdata.cols() : in->data.cols();
+    in.reset();
+    MPI_Allreduce(&n_local, &n_total, 1, MPI_DOUBLE, MPI_SUM, ar_comm.get_comm());
+    t_load = seconds_since(t);
+    vector<layer_stat> st;
+    for (int lyr = 0; lyr < n_lyr; lyr++) {
+      target_cost = lyr < (int)target.size() ? target[lyr] : 0.;
+      n_rounds = 0;
+      t_target = -1.;
+      MPI_Barrier(ar_comm.get_comm());
+      t0 = clk::now();
+      train(lyr);
+      double sec = seconds_since(t0);
+      // the slowest worker decides
+      MPI_Allreduce(MPI_IN_PLACE, &sec, 1, MPI_DOUBLE, MPI_MAX, ar_comm.get_comm());
+      st.push_back(layer_stat{n_rounds, sec, t_target, last_hold});
+    }
+    return st;
+  }
+
+ protected:
+  // every trainer calls converged at the end of each round; last_hold is
+  // the mean holdout cost over all workers, so they all stop together
+  bool converged(int lyr, int rd) override {
+    bool stop = autoencoder::converged(lyr, rd);
+    n_rounds = rd + 1;
+    if (t_target < 0 && target_cost > 0 && early_stopping() && last_hold <= target_cost) {
+      t_target = seconds_since(t0);
+      stop = true;
+    }
+    return stop;
+  }
+
+ private:
+  clk::time_point t0;
+  int n_rounds = 0;
+  double target_cost = 0.;
+  double t_target = -1.;
+};
+
+} // namespace paracel
+
+
+int main(int argc, char *argv[])
+{
+  paracel::main_env comm_main_env(argc, argv);
+  paracel::Comm comm(MPI_COMM_WORLD);
+
+  google::SetUsageMessage("[options]\n\t--server_info\n\t--data\n\t--mnist_dir\n\t--samples\n\t--workdir\n\t--methods\n\t--hidden\n\t--rounds\n\t--target\n");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  int rank = comm.get_rank(), n_workers = comm.get_size();
+  int visible = 0;
+  if (rank == 0) {
+    MatrixXd x;
+    vector<int> labels;
+    auto t = clk::now();
+    if (FLAGS_data == "mnist") {
+      if (!load_mnist(x, labels)) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+    } else {
+      synth_spectra(x, labels);
+    }
+    write_shards(x, labels, n_workers);
+    visible = x.rows();
+    std::cout << x.cols() << " " << FLAGS_data << " samples of " << visible << " written to "
+              << FLAGS_workdir << " in " << seconds_since(t) << "s" << std::endl;
+  }
+  MPI_Bcast(&visible, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+  vector<int> hidden = split_list<int>(FLAGS_hidden);
+  vector<double> target = split_list<double>(FLAGS_target);
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2);
+  for (auto & method : split_list<string>(FLAGS_methods)) {
+    reset_peak_rss();
+    double t_load = 0., n_total = 0.;
+    vector<paracel::layer_stat> st;
+    {
+      paracel::ae_options opt;
+      opt.input = opt.output = FLAGS_workdir;
+      opt.hidden_size = hidden;
+      opt.visible_size = visible;
+      opt.learning_method = method;
+      opt.rounds = FLAGS_rounds;
+      opt.alpha = FLAGS_alpha;
+      opt.lamb = 0.;
+      opt.sparsity_param = 0.05;
+      opt.beta = 0.;
+      opt.mibt_size = FLAGS_mibt_size;
+      opt.read_batch = FLAGS_read_batch;
+      opt.update_batch = FLAGS_update_batch;
+      opt.byte_shard = true;
+      opt.holdout = FLAGS_holdout;
+      // patience beyond the last round: converged reports the holdout cost
+      // of every round without stopping a layer
+      opt.patience = FLAGS_rounds + 1;
+      opt.min_delta = 0.;
+      opt.key_prefix = method + "_";
+      opt.update_lib = FLAGS_update_lib;
+      opt.servers = !paracel::allreduce_method(method);
+      paracel::bench_probe probe(comm, FLAGS_server_info, opt);
+      st = probe.run(target, t_load, n_total);
+    }
+    long rss = peak_rss_kb();
+    MPI_Allreduce(MPI_IN_PLACE, &rss, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+    report << method << ": " << long(n_total) << " samples on " << n_workers << " workers, loaded in "
+           << t_load << "s, peak RSS " << rss / 1024. << " MB" << std::endl;
+    for (size_t l = 0; l < st.size(); l++) {
+      report << "  layer " << l << std::setw(4) << st[l].rounds << " rounds " << std::setw(9) << st[l].seconds
+             << "s " << std::setw(12) << n_total * st[l].rounds / st[l].seconds << " samples/sec  holdout cost "
+             << std::setprecision(5) << st[l].cost << std::setprecision(2);
+      if (l < target.size() && target[l] > 0) {
+        report << ", target " << target[l] << " ";
+        if (st[l].t_target < 0) {
+          report << "not reached";
+        } else {
+          report << "after " << st[l].t_target << "s";
+        }
+      }
+      report << std::endl;
+    }
+  }
+  if (rank == 0) {
+    std::cout << report.str();
+  }
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <string>
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <iostream>
 
 #include <mpi.h>
@@ -8,15 +10,16 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/foreach.hpp>
-//#include <boost/filesystem>
+#include <boost/filesystem.hpp>
 
 #include "ae.hpp"
+#include "ae_numa.hpp"
 #include "fine_tn.hpp"
 #include "utils.hpp"
 
 using namespace boost::property_tree;
 
-DEFINE_string(server_info, "host1:7777PARACELhost2:8888", "hosts name string of paracel-servers.\n");
+DEFINE_string(server_info, "host1:7777PARACELhost2:8888", "hosts name string of paracel-servers, ignored by ardbgd and armbsgd unless fine-tuning follows.\n");
 
 DEFINE_string(cfg_file, "", "config json file with absolute path.\n");
 
@@ -35,6 +38,129 @@ std::vector<int> split(std::string & str, char sep = ','){
   return res;
 }
 
+// the options of a solver configured by pt, whose server keys all start
+// with key_prefix
+paracel::ae_options solver_options(const ptree & pt, const std::string & output,
+                                   const std::string & key_prefix = ""){
+  paracel::ae_options opt;
+  opt.input = pt.get<std::string>("input");
+  opt.output = output;
+  std::string _hidden_size = pt.get<std::string>("hidden_size");
+  opt.hidden_size = split(_hidden_size);
+  opt.visible_size = pt.get<int>("visible_size");
+  opt.learning_method = pt.get<std::string>("learning_method");
+  opt.acti_func_type = pt.get<std::string>("acti_func_type");
+  opt.rounds = pt.get<int>("rounds");
+  opt.alpha = pt.get<double>("alpha");
+  opt.limit_s = pt.get<int>("limit_s");
+  opt.ssp_switch = true;
+  opt.lamb = pt.get<double>("lamb");
+  opt.sparsity_param = pt.get<double>("sparsity_param");
+  opt.beta = pt.get<double>("beta");
+  opt.mibt_size = pt.get<int>("mibt_size");
+  opt.read_batch = pt.get<int>("read_batch");
+  opt.update_batch = pt.get<int>("update_batch");
+  opt.corrupt = pt.get<bool>("corrupt");
+  opt.dvt = pt.get<double>("deviation");
+  opt.foc = pt.get<double>("frac_of_corrupt");
+  opt.n_threads = pt.get<int>("n_threads", opt.n_threads);
+  opt.sync_interval = pt.get<int>("sync_interval", opt.sync_interval);
+  opt.sparse_thld = pt.get<double>("sparse_threshold", opt.sparse_thld);
+  opt.rho_decay = pt.get<double>("rho_decay", opt.rho_decay);
+  opt.rho_ps = pt.get<bool>("rho_ps", opt.rho_ps);
+  opt.tied = pt.get<bool>("tied_weights", opt.tied);
+  opt.dropout = pt.get<double>("dropout", opt.dropout);
+  opt.byte_shard = pt.get<bool>("byte_shard", opt.byte_shard);
+  opt.rebalance = pt.get<bool>("rebalance", opt.rebalance);
+  opt.round_budget = pt.get<double>("round_budget", opt.round_budget);
+  opt.lr_schedule = pt.get<std::string>("lr_schedule", opt.lr_schedule);
+  opt.lr_decay = pt.get<double>("lr_decay", opt.lr_decay);
+  opt.lr_step = pt.get<int>("lr_step", opt.lr_step);
+  opt.lr_min = pt.get<double>("lr_min", opt.lr_min);
+  opt.holdout = pt.get<double>("holdout", opt.holdout);
+  opt.patience = pt.get<int>("patience", opt.patience);
+  opt.min_delta = pt.get<double>("min_delta", opt.min_delta);
+  opt.pin_threads = pt.get<bool>("numa_pin", opt.pin_threads);
+  opt.key_prefix = key_prefix;
+  opt.code_format = pt.get<std::string>("code_format", opt.code_format);
+  opt.ar_chunk = pt.get<int>("ar_chunk", opt.ar_chunk);
+  opt.easgd_tau = pt.get<int>("easgd_tau", opt.easgd_tau);
+  opt.easgd_beta = pt.get<double>("easgd_beta", opt.easgd_beta);
+  opt.init_model = pt.get<std::string>("init_model", opt.init_model);
+  opt.warm_rounds = pt.get<int>("warm_rounds", opt.warm_rounds);
+  opt.freeze_layers = pt.get<int>("freeze_layers", opt.freeze_layers);
+  opt.sample_frac = pt.get<double>("sample_frac", opt.sample_frac);
+  opt.update_lib = pt.get<std::string>("update_lib", opt.update_lib);
+  opt.servers = !paracel::allreduce_method(opt.learning_method);
+  return opt;
+}
+
+// a solver configured by pt, whose server keys all start with key_prefix
+std::unique_ptr<paracel::autoencoder> make_solver(paracel::Comm comm, const ptree & pt,
+                                                  const std::string & output,
+                                                  const std::string & key_prefix = ""){
+  return std::unique_ptr<paracel::autoencoder>(new paracel::autoencoder(
+              comm, FLAGS_server_info, solver_options(pt, output, key_prefix)));
+}
+
+// Every entry of the "sweep" list overrides some keys of the base config
+// and trains one more model on the input loaded by the first one. Keys
+// that decide what is loaded always come from the base config, corrupt
+// among them since it turns sparse loading off; deviation and
+// frac_of_corrupt may still differ per model. The models
+// take turns layer by layer, since sync() and the servers are shared by
+// all of them; each one dumps into output/model_<k>/ unless it sets its
+// own output
+void sweep(paracel::Comm comm, const ptree & pt){
+  const char * data_keys[] = {"input", "visible_size", "sparse_threshold", "byte_shard", "holdout", "patience", "sample_frac", "corrupt"};
+  std::vector<std::unique_ptr<paracel::autoencoder> > models;
+  std::vector<int> n_lyr;
+  int k = 0;
+  for (auto & entry : pt.get_child("sweep")) {
+    ptree m = pt;
+    for (auto & kv : entry.second) {
+      m.put_child(kv.first, kv.second);
+    }
+    for (auto key : data_keys) {
+      if (entry.second.count(key) && comm.get_rank() == 0) {
+        std::cout << "sweep model " << k << " ignores " << key << ", it comes from the base config" << std::endl;
+      }
+      if (pt.count(key)) {
+        m.put_child(key, pt.get_child(key));
+      }
+    }
+    std::string output = entry.second.get<std::string>("output",
+        paracel::todir(pt.get<std::string>("output")) + "model_" + std::to_string(k));
+    if (comm.get_rank() == 0) {
+      boost::filesystem::create_directories(output);
+    }
+    std::string _hidden_size = m.get<std::string>("hidden_size");
+    n_lyr.push_back(split(_hidden_size).size());
+    models.push_back(make_solver(comm, m, output, "m" + std::to_string(k) + "_"));
+    k += 1;
+  }
+  auto in = models[0]->load_shared_input();
+  for (auto & ae : models) {
+    ae->share_input(in);
+  }
+  in.reset();
+  int top = *std::max_element(n_lyr.begin(), n_lyr.end());
+  for (int i = 0; i < top; i++) {
+    for (k = 0; k < (int)models.size(); k++) {
+      if (i >= n_lyr[k]) {
+        continue;
+      }
+      std::cout << "worker" << comm.get_rank() << " model " << k << " starts training layer " << i+1 << std::endl;
+      models[k]->train(i);
+      if (comm.get_rank() == 0) {
+        models[k]->dump_result(i);
+      }
+    }
+  }
+  comm.synchronize();
+  std::cout << "Sweep of " << models.size() << " models complete" << std::endl;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -48,41 +174,51 @@ int main(int argc, char *argv[])
   json_parser::read_json(FLAGS_cfg_file, pt);
   std::string output = pt.get<std::string>("output");
   std::string output_fn = pt.get<std::string>("output_fine_tuning");
-  std::string input = pt.get<std::string>("input");
-  std::string learning_method = pt.get<std::string>("learning_method");
-  std::string acti_func_type = pt.get<std::string>("acti_func_type");
-  std::string _hidden_size = pt.get<std::string>("hidden_size");
-  double alpha = pt.get<double>("alpha");
-  double beta = pt.get<double>("beta");
-  double lamb = pt.get<double>("lamb");
-  double sparsity_param = pt.get<double>("sparsity_param");
-  double dvt = pt.get<double>("deviation");
-  double foc = pt.get<double>("frac_of_corrupt");
-  int rounds = pt.get<int>("rounds");
-  int limit_s = pt.get<int>("limit_s");
-  int mibt_size = pt.get<int>("mibt_size");
-  int visible_size = pt.get<int>("visible_size");
-  int read_batch = pt.get<int>("read_batch");
-  int update_batch = pt.get<int>("update_batch");
-  bool corrupt = pt.get<bool>("corrupt");
+  bool numa_pin = pt.get<bool>("numa_pin", false);
   bool fine_tuning = pt.get<bool>("fine_tuning");
+  int fn_frozen = pt.get<int>("fn_frozen_layers", 0);
+  std::string grad_check = pt.get<std::string>("grad_check", "");
 
-  // Processing the parsing
-  vector<int> hidden_size = split(_hidden_size);
+  if (numa_pin) {
+    // pin before anything is loaded, so the data, the weights and the load
+    // buffers are first touched and placed on the rank's own node
+    MPI_Comm host_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &host_comm);
+    int local_rank, local_size;
+    MPI_Comm_rank(host_comm, &local_rank);
+    MPI_Comm_size(host_comm, &local_size);
+    MPI_Comm_free(&host_comm);
+    std::vector<int> node_ids, cpus;
+    paracel::numa_place(paracel::numa_nodes(), local_rank, local_size, node_ids, cpus);
+    if (paracel::pin_cpus(cpus)) {
+      if (node_ids.size() > 1) {
+        paracel::interleave_nodes(node_ids);
+      }
+      std::cout << "worker" << comm.get_rank() << " pinned to node " << paracel::cpus_str(node_ids)
+                << ", cpus " << paracel::cpus_str(cpus) << std::endl;
+    }
+  }
 //  if(!boost::filesystem::exists(input))
 //    boost::filesystem::create_directories(input);
 //  if(!boost::filesystem::exists(output))
 //    boost::filesystem::create_directories(output);
 
+  if (pt.get_child("sweep", ptree()).size()) {
+    sweep(comm, pt);
+    return 0;
+  }
+
   {
-    paracel::autoencoder ae_solver(comm, FLAGS_server_info, input, output, hidden_size, visible_size, learning_method, acti_func_type, rounds, alpha, false, limit_s,
-              true, lamb, sparsity_param, beta, mibt_size, read_batch, update_batch, corrupt, dvt, foc);
-    ae_solver.train();
+    auto ae_solver = make_solver(comm, pt, output);
+    ae_solver->train();
     if(fine_tuning){
-      paracel::fine_tune fine_tn(comm, FLAGS_server_info, input, output_fn, hidden_size, visible_size, ae_solver.GetWgtBias(), learning_method, acti_func_type, rounds, alpha, false, limit_s,
-              true, lamb, sparsity_param, beta, mibt_size, read_batch, update_batch, 14);
-      fine_tn.smx_nume_grad();
-      // TODO setup fine-tuning.
+      // the stack comes from the solver above, not from init_model
+      paracel::ae_options fn_opt = solver_options(pt, output_fn);
+      fn_opt.init_model = "";
+      fn_opt.servers = true;  // fine-tuning always exchanges through the servers
+      paracel::fine_tune fine_tn(comm, FLAGS_server_info, fn_opt, ae_solver->GetWgtBias(), 14,
+                                 fn_frozen, grad_check);
+      fine_tn.fn_train();
     }
   }
 
@@ -0,0 +1,272 @@
+// Genre accuracy of a trained stack, the native counterpart of svm_test.py.
+// The train and test patch files (spec_patch output) are encoded with the
+// dumped encoder; every song becomes the codes of its patches one after the
+// other, as in svm_test.py, or their mean. A softmax classifier is fit on
+// the train songs with mini-batch SGD on Hogwild threads, labels being the
+// index of the genre id in --gid (GID of songs/sid_label.py). Accuracy and
+// the confusion matrix are reported for the validation songs (the first
+// --validate_num train songs, kept out of the fit) and the test songs.
+//   ae_eval --model <output of ae> --train <patches> --test <patches>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <random>
+#include <cmath>
+
+#include <google/gflags.h>
+
+#include "ae_model.hpp"
+
+DEFINE_string(model, "", "output directory of ae holding ae_layer_<l>_W1/_b1.\n");
+
+DEFINE_string(acti_func_type, "sigmoid", "activation the model was trained with.\n");
+
+DEFINE_int32(n_layers, -1, "encoder layers used, -1 means all of them, 0 the raw patches.\n");
+
+DEFINE_string(train, "", "train patch file or directory of patch files.\n");
+
+DEFINE_string(test, "", "test patch file or directory, may be empty.\n");
+
+DEFINE_int32(visible, 513, "values per patch.\n");
+
+DEFINE_int32(patches_per_song, 30, "consecutive patches of a file forming one song.\n");
+
+DEFINE_string(features, "concat", "song features: concat or mean of the patch codes.\n");
+
+DEFINE_int32(validate_num, 10000, "first train songs used for validation only.\n");
+
+DEFINE_string(gid, "324,325,326,327,328,329,330,331,332,333,334,335,336,337", "genre ids, the label of a song is its index here.\n");
+
+DEFINE_int32(epochs, 20, "passes over the train songs.\n");
+
+DEFINE_double(alpha, 0.1, "learning rate of the first epoch.\n");
+
+DEFINE_double(lr_decay, 0.9, "factor of the learning rate per epoch.\n");
+
+DEFINE_double(lamb, 1e-4, "weight decay.\n");
+
+DEFINE_int32(mibt_size, 64, "mini-batch size.\n");
+
+DEFINE_bool(balance, false, "weight the loss of every genre by max count / count, like the svm weights of svm_test.py.\n");
+
+DEFINE_int32(n_threads, 0, "threads, 0 means one per core.\n");
+
+DEFINE_int32(seed, 1, "seed of the sample order.\n");
+
+typedef std::chrono::steady_clock clk;
+
+static double seconds_since(clk::time_point t0) {
+  return std::chrono::duration<double>(clk::now() - t0).count();
+}
+
+static int n_threads() {
+  return FLAGS_n_threads > 0 ? FLAGS_n_threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// run f(t) on threads t = 0 .. n - 1
+template <class F>
+static void parallel(int n, F f) {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n; t++) {
+    threads.push_back(std::thread(f, t));
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+}
+
+// encoded songs whose genre is in gid, with the label replaced by its index
+static paracel::song_set load_set(const paracel::ae_model & model, const string & path, const vector<int> & gid) {
+  paracel::song_set s = paracel::encode_songs(model, paracel::sample_files(path), FLAGS_visible,
+                                              FLAGS_patches_per_song, FLAGS_features == "concat", n_threads());
+  int n = 0;
+  for (size_t k = 0; k < s.labels.size(); k++) {
+    auto it = std::find(gid.begin(), gid.end(), s.labels[k]);
+    if (it == gid.end()) {
+      continue;
+    }
+    s.x.col(n) = s.x.col(k);
+    s.labels[n] = it - gid.begin();
+    n += 1;
+  }
+  if (n < (int)s.labels.size()) {
+    std::cout << path << ": " << s.labels.size() - n << " songs of other genres skipped" << std::endl;
+  }
+  s.x.conservativeResize(Eigen::NoChange, n);
+  s.labels.resize(n);
+  return s;
+}
+
+// z = softmax(W x + b), one column per sample
+static void predict_proba(const MatrixXd & W, const VectorXd & b, const Eigen::Ref<const MatrixXd> & x, MatrixXd & z) {
+  z.noalias() = W * x;
+  z.colwise() += b;
+  z.rowwise() -= z.colwise().maxCoeff();
+  z = z.array().exp();
+  z.array().rowwise() /= z.colwise().sum().array();
+}
+
+static vector<int> predict(const MatrixXd & W, const VectorXd & b, const MatrixXd & x) {
+  vector<int> y(x.cols());
+  MatrixXd z;
+  for (int st = 0; st < x.cols(); st += 4096) {
+    int len = std::min<int>(4096, x.cols() - st);
+    predict_proba(W, b, x.middleCols(st, len), z);
+    for (int j = 0; j < len; j++) {
+      z.col(j).maxCoeff(&y[st + j]);
+    }
+  }
+  return y;
+}
+
+// confusion(t, p) counts songs of genre t predicted as p
+static void report(const string & name, const vector<int> & y, const vector<int> & p, const vector<int> & gid) {
+  int c = gid.size();
+  Eigen::MatrixXi conf = Eigen::MatrixXi::Zero(c, c);
+  for (size_t k = 0; k < y.size(); k++) {
+    conf(y[k], p[k]) += 1;
+  }
+  std::cout << name << " accuracy " << std::fixed << std::setprecision(4)
+            << double(conf.trace()) / std::max<size_t>(y.size(), 1) << " over " << y.size() << " songs" << std::endl;
+  std::cout << "confusion, rows true genre, columns predicted" << std::endl << std::setw(6) << "";
+  for (int j = 0; j < c; j++) {
+    std::cout << std::setw(6) << gid[j];
+  }
+  std::cout << "  recall" << std::endl;
+  for (int i = 0; i < c; i++) {
+    std::cout << std::setw(6) << gid[i];
+    for (int j = 0; j < c; j++) {
+      std::cout << std::setw(6) << conf(i, j);
+    }
+    int n = conf.row(i).sum();
+    std::cout << "  " << (n ? double(conf(i, i)) / n : 0.) << std::endl;
+  }
+  std::cout << std::defaultfloat;
+}
+
+
+int main(int argc, char *argv[])
+{
+  google::SetUsageMessage("[options]\n\t--model\n\t--train\n\t--test\n\t--patches_per_song\n\t--features\n\t--epochs\n");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  vector<int> gid;
+  std::stringstream ss(FLAGS_gid);
+  string item;
+  while (std::getline(ss, item, ',')) {
+    gid.push_back(std::stoi(item));
+  }
+  int c = gid.size();
+
+  paracel::ae_model model(FLAGS_model, FLAGS_acti_func_type, FLAGS_n_layers);
+  if (model.in_size() != FLAGS_visible && FLAGS_n_layers != 0) {
+    std::cerr << "no encoder of input size " << FLAGS_visible << " in " << FLAGS_model << std::endl;
+    return 1;
+  }
+  auto t0 = clk::now();
+  paracel::song_set tr = load_set(model, FLAGS_train, gid);
+  paracel::song_set te;
+  if (!FLAGS_test.empty()) {
+    te = load_set(model, FLAGS_test, gid);
+  }
+  std::cout << tr.labels.size() + te.labels.size() << " songs of " << tr.x.rows() << " features encoded in "
+            << seconds_since(t0) << "s" << std::endl;
+
+  // the validation songs come first, as in svm_test.py
+  int n_va = std::min<int>(std::max(FLAGS_validate_num, 0), tr.labels.size());
+  int n_tr = tr.labels.size() - n_va;
+  if (n_tr == 0) {
+    std::cerr << "no train songs left after " << n_va << " validation songs" << std::endl;
+    return 1;
+  }
+  const MatrixXd & x = tr.x;
+  const vector<int> & y = tr.labels;
+
+  // features standardized on the train songs
+  int d = x.rows();
+  VectorXd mu = x.rightCols(n_tr).rowwise().mean();
+  VectorXd sd = ((x.rightCols(n_tr).colwise() - mu).array().square().rowwise().sum() / n_tr).sqrt().max(1e-8);
+  tr.x = (tr.x.colwise() - mu).array().colwise() / sd.array();
+  if (te.x.size()) {
+    te.x = (te.x.colwise() - mu).array().colwise() / sd.array();
+  }
+
+  VectorXd cw = VectorXd::Ones(c);
+  if (FLAGS_balance) {
+    VectorXd cnt = VectorXd::Zero(c);
+    for (int k = n_va; k < n_va + n_tr; k++) {
+      cnt(y[k]) += 1;
+    }
+    for (int i = 0; i < c; i++) {
+      cw(i) = cnt(i) ? cnt.maxCoeff() / cnt(i) : 0.;
+    }
+  }
+
+  // Hogwild: every thread steps the shared W and b with the gradients of
+  // its own mini-batches, without locks
+  MatrixXd W = MatrixXd::Zero(c, d);
+  VectorXd b = VectorXd::Zero(c);
+  vector<int> order(n_tr);
+  std::iota(order.begin(), order.end(), n_va);
+  std::mt19937 rng(FLAGS_seed);
+  int nt = std::min(n_threads(), n_tr);
+  int bs = std::max(FLAGS_mibt_size, 1);
+  double alpha = FLAGS_alpha;
+  t0 = clk::now();
+  for (int ep = 0; ep < FLAGS_epochs; ep++) {
+    std::shuffle(order.begin(), order.end(), rng);
+    vector<double> loss(nt, 0.);
+    parallel(nt, [&] (int t) {
+      int st = (long)n_tr * t / nt, en = (long)n_tr * (t + 1) / nt;
+      MatrixXd xb(d, bs), z, g;
+      for (int i = st; i < en; i += bs) {
+        int m = std::min(bs, en - i);
+        xb.resize(d, m);
+        for (int j = 0; j < m; j++) {
+          xb.col(j) = x.col(order[i + j]);
+        }
+        predict_proba(W, b, xb, z);
+        // z becomes the weighted error of the cross entropy
+        for (int j = 0; j < m; j++) {
+          int yj = y[order[i + j]];
+          loss[t] -= cw(yj) * std::log(std::max(z(yj, j), 1e-300));
+          z(yj, j) -= 1;
+          z.col(j) *= cw(yj) / m;
+        }
+        g.noalias() = z * xb.transpose();
+        W -= alpha * (g + FLAGS_lamb * W);
+        b -= alpha * z.rowwise().sum();
+      }
+    });
+    std::cout << "epoch " << ep + 1 << " loss " << std::accumulate(loss.begin(), loss.end(), 0.) / n_tr;
+    if (n_va) {
+      vector<int> p = predict(W, b, x.leftCols(n_va));
+      int hit = 0;
+      for (int k = 0; k < n_va; k++) {
+        hit += p[k] == y[k];
+      }
+      std::cout << " validation accuracy " << double(hit) / n_va;
+    }
+    std::cout << std::endl;
+    alpha *= FLAGS_lr_decay;
+  }
+  std::cout << "softmax fit on " << n_tr << " songs with " << nt << " threads in " << seconds_since(t0) << "s" << std::endl;
+
+  vector<int> p = predict(W, b, x.rightCols(n_tr));
+  report("train", vector<int>(y.begin() + n_va, y.end()), p, gid);
+  if (n_va) {
+    p = predict(W, b, x.leftCols(n_va));
+    report("validation", vector<int>(y.begin(), y.begin() + n_va), p, gid);
+  }
+  if (te.labels.size()) {
+    p = predict(W, b, te.x);
+    report("test", te.labels, p, gid);
+  }
+  return 0;
+}
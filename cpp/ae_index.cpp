@@ -0,0 +1,212 @@
+// Song similarity search over the codes of a trained stack. build encodes
+// the patch files written by spec_patch with the dumped encoder, averages
+// the codes of every song and stores them in an exact index (<index>.flat)
+// and an IVF-PQ index (<index>.ivfpq), together with the label of every
+// song (<index>.labels). bench measures recall@k and queries per second of
+// IVF-PQ against the exact search, query prints the neighbours of a song.
+//   ae_index --mode build --model <output of ae> --input <patches> --index songs
+//   ae_index --mode bench --index songs --nprobe 1,4,16,64
+//   ae_index --mode query --index songs --query_id 42
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <random>
+
+#include <google/gflags.h>
+
+#include "ae_model.hpp"
+#include "ann_index.hpp"
+
+DEFINE_string(mode, "build", "build, bench or query.\n");
+
+DEFINE_string(model, "", "output directory of ae holding ae_layer_<l>_W1/_b1.\n");
+
+DEFINE_string(acti_func_type, "sigmoid", "activation the model was trained with.\n");
+
+DEFINE_int32(n_layers, -1, "encoder layers used, -1 means all of them.\n");
+
+DEFINE_string(input, "", "patch file or directory of patch files.\n");
+
+DEFINE_int32(visible, 513, "values per patch.\n");
+
+DEFINE_int32(patches_per_song, 30, "consecutive patches of a file forming one song, 0 indexes single patches.\n");
+
+DEFINE_string(index, "ae_index", "path prefix of the index files.\n");
+
+DEFINE_int32(nlist, 1024, "IVF cells.\n");
+
+DEFINE_int32(pq_m, 8, "PQ sub-vectors, one byte each.\n");
+
+DEFINE_int32(kmeans_iters, 20, "k-means iterations.\n");
+
+DEFINE_int32(n_train, 65536, "vectors sampled to train the quantizers.\n");
+
+DEFINE_int32(k, 10, "neighbours per query.\n");
+
+DEFINE_int32(n_queries, 1000, "random stored vectors used as queries by bench.\n");
+
+DEFINE_string(nprobe, "1,2,4,8,16,32,64", "comma separated cells probed per query.\n");
+
+DEFINE_int32(n_threads, 0, "threads, 0 means one per core.\n");
+
+DEFINE_int32(query_id, 0, "song queried by query.\n");
+
+using paracel::RowMatrixXf;
+
+typedef std::chrono::steady_clock clk;
+
+static double seconds_since(clk::time_point t0) {
+  return std::chrono::duration<double>(clk::now() - t0).count();
+}
+
+static int n_threads() {
+  return FLAGS_n_threads > 0 ? FLAGS_n_threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// run f(t) on threads t = 0 .. n - 1
+template <class F>
+static void parallel(int n, F f) {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n; t++) {
+    threads.push_back(std::thread(f, t));
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+}
+
+// one vector per song (or per patch), in file order
+static void build() {
+  paracel::ae_model model(FLAGS_model, FLAGS_acti_func_type, FLAGS_n_layers);
+  if (model.n_layers() == 0 || model.in_size() != FLAGS_visible) {
+    std::cerr << "no encoder of input size " << FLAGS_visible << " in " << FLAGS_model << std::endl;
+    exit(-1);
+  }
+  auto t0 = clk::now();
+  paracel::song_set songs = paracel::encode_songs(model, paracel::sample_files(FLAGS_input), FLAGS_visible,
+                                                  FLAGS_patches_per_song, false, n_threads());
+  double t_enc = seconds_since(t0);
+
+  size_t n = songs.labels.size();
+  RowMatrixXf all = songs.x.transpose().cast<float>();
+  songs.x.resize(0, 0);
+  std::vector<int64_t> ids(n);
+  std::ofstream ls(FLAGS_index + ".labels");
+  for (size_t r = 0; r < n; r++) {
+    ids[r] = r;
+    ls << r << " " << songs.labels[r] << " " << songs.where[r] << "\n";
+  }
+  std::cout << n << " vectors of " << all.cols() << " encoded in " << t_enc << "s" << std::endl;
+
+  t0 = clk::now();
+  paracel::flat_index::write(FLAGS_index + ".flat", all, ids);
+  paracel::ivfpq_params params;
+  params.nlist = FLAGS_nlist;
+  params.m = FLAGS_pq_m;
+  params.iters = FLAGS_kmeans_iters;
+  params.n_train = FLAGS_n_train;
+  paracel::ivfpq_index::build(FLAGS_index + ".ivfpq", all, ids, params);
+  std::cout << "indexes written to " << FLAGS_index << ".{flat,ivfpq} in " << seconds_since(t0) << "s" << std::endl;
+}
+
+// search(slice) on consecutive slices of the queries, one per thread
+template <class F>
+static paracel::ann_result search_all(const RowMatrixXf & q, F search) {
+  paracel::ann_result res(q.rows());
+  int nt = std::min<int>(n_threads(), q.rows());
+  parallel(nt, [&] (int t) {
+    int st = q.rows() * t / nt, en = q.rows() * (t + 1) / nt;
+    paracel::ann_result r = search(q.middleRows(st, en - st));
+    std::move(r.begin(), r.end(), res.begin() + st);
+  });
+  return res;
+}
+
+static void bench() {
+  paracel::flat_index flat(FLAGS_index + ".flat");
+  paracel::ivfpq_index ivf(FLAGS_index + ".ivfpq");
+  int nq = std::min<size_t>(FLAGS_n_queries, flat.size());
+  std::mt19937 rng(1);
+  RowMatrixXf q(nq, flat.dim());
+  for (int i = 0; i < nq; i++) {
+    q.row(i) = flat.vectors().row(rng() % flat.size());
+  }
+  std::cout << flat.size() << " vectors of " << flat.dim() << ", " << ivf.n_list() << " cells, "
+            << ivf.bytes_per_vector() << " bytes per vector against "
+            << flat.dim() * sizeof(float) + sizeof(int64_t) << ", " << nq << " queries, "
+            << n_threads() << " threads" << std::endl;
+
+  auto t0 = clk::now();
+  paracel::ann_result truth = search_all(q, [&] (const RowMatrixXf & b) { return flat.search(b, FLAGS_k); });
+  double t = seconds_since(t0);
+  std::cout << std::fixed << std::setw(8) << "exact" << "  recall@" << FLAGS_k << " 1.0000  qps "
+            << std::setw(10) << std::setprecision(0) << nq / t << std::endl;
+
+  std::stringstream ss(FLAGS_nprobe);
+  string item;
+  while (std::getline(ss, item, ',')) {
+    int nprobe = std::stoi(item);
+    t0 = clk::now();
+    paracel::ann_result res = search_all(q, [&] (const RowMatrixXf & b) { return ivf.search(b, FLAGS_k, nprobe); });
+    t = seconds_since(t0);
+    size_t hit = 0, tot = 0;
+    for (int i = 0; i < nq; i++) {
+      for (auto & h : truth[i]) {
+        tot += 1;
+        for (auto & g : res[i]) {
+          if (g.id == h.id) { hit += 1; break; }
+        }
+      }
+    }
+    std::cout << "nprobe " << std::setw(3) << nprobe << "  recall@" << FLAGS_k << " "
+              << std::setprecision(4) << double(hit) / std::max<size_t>(tot, 1)
+              << "  qps " << std::setw(10) << std::setprecision(0) << nq / t << std::endl;
+  }
+}
+
+static void query() {
+  paracel::flat_index flat(FLAGS_index + ".flat");
+  if (FLAGS_query_id < 0 || (size_t)FLAGS_query_id >= flat.size()) {
+    std::cerr << "query_id out of [0, " << flat.size() << ")" << std::endl;
+    exit(-1);
+  }
+  vector<string> desc(flat.size());
+  std::ifstream ls(FLAGS_index + ".labels");
+  string line;
+  while (std::getline(ls, line)) {
+    size_t sp = line.find(' ');
+    size_t i = std::stoul(line.substr(0, sp));
+    if (i < desc.size()) desc[i] = line.substr(sp + 1);
+  }
+  RowMatrixXf q = flat.vectors().row(FLAGS_query_id);
+  paracel::ann_result res = flat.search(q, FLAGS_k);
+  std::cout << "query " << FLAGS_query_id << " " << desc[FLAGS_query_id] << std::endl;
+  for (auto & h : res[0]) {
+    std::cout << std::setw(10) << h.id << "  " << std::setw(12) << h.dist << "  " << desc[h.id] << std::endl;
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  google::SetUsageMessage("[options]\n\t--mode\n\t--model\n\t--input\n\t--index\n\t--patches_per_song\n\t--nprobe\n");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_mode == "build") {
+    build();
+  } else if (FLAGS_mode == "bench") {
+    bench();
+  } else if (FLAGS_mode == "query") {
+    query();
+  } else {
+    std::cerr << "unknown mode " << FLAGS_mode << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+#ifndef _AE_KERNEL_HPP_
+#define _AE_KERNEL_HPP_
+
+#include <vector>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <eigen3/Eigen/Dense>
+
+namespace paracel{
+
+// bump allocator over one aligned block, sized once and handed out as
+// Eigen maps. Memory is given back in stack order through frames, so a
+// routine that opens a frame leaves the workspace as it found it.
+class workspace {
+ public:
+  typedef Eigen::Map<Eigen::MatrixXd, Eigen::Aligned16> mat_t;
+  typedef Eigen::Map<Eigen::VectorXd, Eigen::Aligned16> vec_t;
+
+  // capacity in doubles; may only grow while nothing is handed out
+  void reserve(size_t n) {
+    if (n > buf.size()) {
+      assert(top == 0);
+      buf.resize(n);
+    }
+  }
+
+  mat_t mat(int r, int c) {
+    return mat_t(bump(size_t(r) * c), r, c);
+  }
+
+  vec_t vec(int n) {
+    return vec_t(bump(n), n);
+  }
+
+  size_t capacity() const { return buf.size(); }
+
+  class frame {
+   public:
+    explicit frame(workspace & _ws) : ws(_ws), mark(_ws.top) {}
+    ~frame() { ws.top = mark; }
+   private:
+    workspace & ws;
+    size_t mark;
+  };
+
+ private:
+  // blocks are rounded up to 4 doubles, so every block keeps the alignment
+  // of the base: at least the 16 bytes of aligned_allocator that the
+  // Aligned16 maps rely on, 32 when Eigen aligns for AVX
+  double * bump(size_t n) {
+    double * p = buf.data() + top;
+    top += (n + 3) & ~size_t(3);
+    assert(top <= buf.size() && "workspace too small");
+    return p;
+  }
+
+  std::vector<double, Eigen::aligned_allocator<double> > buf;
+  size_t top = 0;
+};
+
+
+// G += sum_j u_j * v_j^T over a stream of sample pairs. Pairs are buffered
+// k at a time and applied as a single rank-k GEMM. Eigen tiles that product
+// to the cache sizes and packs its panels into aligned buffers, so G goes
+// through memory once per k samples instead of once per sample.
+class outer_acc {
+ public:
+  // V starts on an even offset, so both buffers keep the 16-byte
+  // alignment of own
+  outer_acc(Eigen::Ref<Eigen::MatrixXd> _G, int _k = 32) :
+      G(_G), own(v_off(_G.rows(), _k) + size_t(_G.cols()) * _k),
+      U(own.data(), _G.rows(), _k), V(own.data() + v_off(_G.rows(), _k), _G.cols(), _k),
+      k(_k), n(0) {}
+
+  // buffers taken from a workspace
+  outer_acc(Eigen::Ref<Eigen::MatrixXd> _G, workspace & ws, int _k) :
+      G(_G), U(ws.mat(_G.rows(), _k).data(), _G.rows(), _k),
+      V(ws.mat(_G.cols(), _k).data(), _G.cols(), _k), k(_k), n(0) {}
+
+  template <class DU, class DV>
+  void add(const Eigen::MatrixBase<DU> & u, const Eigen::MatrixBase<DV> & v, double scale = 1.) {
+    if (n == k) {
+      flush();
+    }
+    U.col(n) = scale * u;
+    V.col(n) = v;
+    n++;
+  }
+
+  // apply the buffered pairs, G is only up to date after this
+  void flush() {
+    if (n) {
+      G.noalias() += U.leftCols(n) * V.leftCols(n).transpose();
+      n = 0;
+    }
+  }
+
+  Eigen::Ref<Eigen::MatrixXd> & target() { return G; }
+
+ private:
+  static size_t v_off(int r, int k) { return (size_t(r) * k + 1) & ~size_t(1); }
+
+  Eigen::Ref<Eigen::MatrixXd> G;
+  std::vector<double, Eigen::aligned_allocator<double> > own;
+  Eigen::Map<Eigen::MatrixXd, Eigen::Aligned16> U, V;
+  int k, n;
+};
+
+
+// samples kept one per column in 16-bit bfloat16 or in 8-bit fixed point
+// over [lo, hi], and widened back to double one column at a time. bf16
+// keeps 8 bits of mantissa, u8 a step of (hi - lo) / 255.
+class code_store {
+ public:
+  enum format { bf16, u8 };
+
+  void resize(int _r, int _c, format _fmt, double _lo = 0., double _hi = 1.) {
+    r = _r;
+    c = _c;
+    fmt = _fmt;
+    lo = _lo;
+    step = _hi > _lo ? (_hi - _lo) / 255 : 1.;
+    half.assign(fmt == bf16 ? size_t(r) * c : 0, 0);
+    byte.assign(fmt == u8 ? size_t(r) * c : 0, 0);
+  }
+
+  void clear() { resize(0, 0, fmt); }
+
+  int rows() const { return r; }
+  int cols() const { return c; }
+  bool empty() const { return c == 0; }
+  size_t bytes() const { return half.size() * sizeof(uint16_t) + byte.size(); }
+
+  // columns j0.. of the store from the columns of m
+  void set_cols(int j0, const Eigen::MatrixXd & m) {
+    assert(m.rows() == r && j0 + m.cols() <= c);
+    size_t off = size_t(j0) * r, n = m.size();
+    const double * x = m.data();
+    if (fmt == bf16) {
+      for (size_t k = 0; k < n; k++) {
+        half[off + k] = to_bf16(x[k]);
+      }
+    } else {
+      double inv = 1. / step;
+      for (size_t k = 0; k < n; k++) {
+        double q = std::round((x[k] - lo) * inv);
+        byte[off + k] = uint8_t(std::min(std::max(q, 0.), 255.));
+      }
+    }
+  }
+
+  // out = column i
+  void widen_col(int i, double * out) const {
+    size_t off = size_t(i) * r;
+    if (fmt == bf16) {
+      for (int k = 0; k < r; k++) {
+        out[k] = from_bf16(half[off + k]);
+      }
+    } else {
+      for (int k = 0; k < r; k++) {
+        out[k] = lo + step * byte[off + k];
+      }
+    }
+  }
+
+  // columns j0.. into the columns of out
+  void widen_cols(int j0, Eigen::Ref<Eigen::MatrixXd> out) const {
+    for (int j = 0; j < out.cols(); j++) {
+      widen_col(j0 + j, out.col(j).data());
+    }
+  }
+
+  // round to nearest even on the upper half of the float
+  static uint16_t to_bf16(double x) {
+    float f = float(x);
+    uint32_t u;
+    std::memcpy(&u, &f, 4);
+    if ((u & 0x7fffffff) > 0x7f800000) {
+      return uint16_t((u >> 16) | 0x40);  // quiet nan
+    }
+    return uint16_t((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+  }
+
+  static double from_bf16(uint16_t h) {
+    uint32_t u = uint32_t(h) << 16;
+    float f;
+    std::memcpy(&f, &u, 4);
+    return f;
+  }
+
+ private:
+  int r = 0, c = 0;
+  format fmt = bf16;
+  double lo = 0., step = 1.;
+  std::vector<uint16_t> half;
+  std::vector<uint8_t> byte;
+};
+
+} // namespace paracel
+
+#endif
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include "ae_model.hpp"
+
+namespace paracel{
+
+MatrixXd load_mat(const string & filename) {
+  std::ifstream is(filename);
+  if (!is) {
+    std::cerr << "can not open " << filename << std::endl;
+    return MatrixXd();
+  }
+  vector<double> v;
+  int rows = 0;
+  size_t cols = 0;
+  string line;
+  while (std::getline(is, line)) {
+    const char * p = line.c_str();
+    char * end;
+    size_t n = 0;
+    for (double d = std::strtod(p, &end); end != p; d = std::strtod(p, &end)) {
+      v.push_back(d);
+      p = end;
+      n += 1;
+    }
+    if (n == 0) continue;
+    if (rows && n != cols) {
+      std::cerr << filename << ": row " << rows << " has " << n << " values, expected " << cols << std::endl;
+      return MatrixXd();
+    }
+    cols = n;
+    rows += 1;
+  }
+  MatrixXd m(rows, cols);
+  m = Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> >(v.data(), rows, cols);
+  return m;
+}
+
+vector<string> sample_files(const string & path) {
+  vector<string> files;
+  if (!boost::filesystem::is_directory(path)) {
+    files.push_back(path);
+    return files;
+  }
+  for (boost::filesystem::directory_iterator it(path), end; it != end; ++it) {
+    if (boost::filesystem::is_regular_file(it->path()) &&
+        it->path().filename().string()[0] != '.') {
+      files.push_back(it->path().string());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+void load_samples(const string & filename, int dim, MatrixXd & x, vector<int> & labels) {
+  std::ifstream is(filename);
+  vector<double> v;
+  labels.clear();
+  string line;
+  while (std::getline(is, line)) {
+    const char * p = line.c_str();
+    char * end;
+    int n = 0;
+    size_t st = v.size();
+    for (double d = std::strtod(p, &end); end != p; d = std::strtod(p, &end)) {
+      v.push_back(d);
+      p = end;
+      n += 1;
+    }
+    if (n == 0) continue;
+    if (n != dim && n != dim + 1) {
+      std::cerr << filename << ": skip a line of " << n << " values" << std::endl;
+      v.resize(st);
+      continue;
+    }
+    labels.push_back(n == dim ? -1 : int(v.back()));
+    v.resize(st + dim);
+  }
+  x = MatrixXd::Map(v.data(), dim, labels.size());
+}
+
+
+ae_model::ae_model(const string & dir, const string & _acti_func_type, int n_lyr) :
+    acti_func_type(_acti_func_type) {
+  string base = dir.empty() || dir.back() == '/' ? dir : dir + "/";
+  for (int l = 0; n_lyr < 0 || l < n_lyr; l++) {
+    string w1 = base + "ae_layer_" + std::to_string(l) + "_W1";
+    if (!boost::filesystem::exists(w1)) {
+      break;
+    }
+    W.push_back(load_mat(w1));
+    b.push_back(load_mat(base + "ae_layer_" + std::to_string(l) + "_b1").col(0));
+    assert(b.back().size() == W.back().rows());
+    assert(l == 0 || W.back().cols() == W[l-1].rows());
+  }
+  if (n_lyr > 0 && (int)W.size() < n_lyr) {
+    std::cerr << dir << " holds " << W.size() << " layers only" << std::endl;
+  }
+}
+
+int ae_model::out_size(int n) const {
+  if (n < 0 || n > n_layers()) {
+    n = n_layers();
+  }
+  return n == 0 ? in_size() : W[n-1].rows();
+}
+
+MatrixXd ae_model::encode(const MatrixXd & x, int n) const {
+  if (n < 0 || n > n_layers()) {
+    n = n_layers();
+  }
+  MatrixXd a = x;
+  for (int l = 0; l < n; l++) {
+    MatrixXd z = W[l] * a;
+    z.colwise() += b[l];
+    acti_apply(z);
+    a.swap(z);
+  }
+  return a;
+}
+
+// same activations as autoencoder::acti_apply
+void ae_model::acti_apply(Eigen::Ref<MatrixXd> z) const {
+  if (acti_func_type == "sigmoid") {
+    z.array() = 1.0 / (1 + (-z.array()).exp());
+  } else if (acti_func_type == "ReLU") {
+    z.array() = z.array().max(0.);
+  } else if (acti_func_type == "tanh") {
+    z.array() = z.array().tanh();
+  } else {
+    std::cerr << "The activation function is not implemented by far." << std::endl;
+    exit(-1);
+  }
+}
+
+
+song_set encode_songs(const ae_model & model, const vector<string> & files, int dim,
+                      int per, bool concat, int n_threads) {
+  per = std::max(per, 1);
+  int c_dim = model.n_layers() ? model.out_size() : dim;
+  vector<song_set> part(files.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&] () {
+    MatrixXd x;
+    vector<int> lbl;
+    for (size_t f = next++; f < files.size(); f = next++) {
+      load_samples(files[f], dim, x, lbl);
+      int n_songs = concat ? x.cols() / per : (x.cols() + per - 1) / per;
+      if (x.cols() % per) {
+        std::cerr << files[f] << ": last song has " << x.cols() % per << " patches" << std::endl;
+      }
+      song_set & s = part[f];
+      s.x.setZero(concat ? c_dim * per : c_dim, n_songs);
+      // a block of songs at a time keeps the activations small
+      int blk = std::max(1, 4096 / per) * per;
+      for (int st = 0; st < n_songs * per && st < x.cols(); st += blk) {
+        int len = std::min<int>(blk, x.cols() - st);
+        MatrixXd c = model.encode(x.middleCols(st, len));
+        for (int j = 0; j < len && (st + j) / per < n_songs; j++) {
+          int k = (st + j) / per;
+          if (concat) {
+            s.x.block(((st + j) % per) * c_dim, k, c_dim, 1) = c.col(j);
+          } else {
+            s.x.col(k) += c.col(j);
+          }
+        }
+      }
+      for (int k = 0; k < n_songs; k++) {
+        if (!concat) {
+          s.x.col(k) /= std::min(per, (int)x.cols() - k * per);
+        }
+        s.labels.push_back(lbl[k * per]);
+        s.where.push_back(files[f] + ":" + std::to_string(k * per));
+      }
+    }
+  };
+  vector<std::thread> threads;
+  for (int t = 0; t < std::max(n_threads, 1); t++) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+
+  song_set all;
+  size_t n = 0;
+  for (auto & s : part) n += s.labels.size();
+  all.x.resize(concat ? c_dim * per : c_dim, n);
+  n = 0;
+  for (auto & s : part) {
+    all.x.middleCols(n, s.labels.size()) = s.x;
+    all.labels.insert(all.labels.end(), s.labels.begin(), s.labels.end());
+    all.where.insert(all.where.end(), s.where.begin(), s.where.end());
+    n += s.labels.size();
+    s.x.resize(0, 0);
+  }
+  return all;
+}
+
+} // namespace paracel
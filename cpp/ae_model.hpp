@@ -0,0 +1,66 @@
+#ifndef _AE_MODEL_HPP_
+#define _AE_MODEL_HPP_
+
+#include <string>
+#include <vector>
+#include <eigen3/Eigen/Dense>
+
+using namespace std;
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+
+namespace paracel{
+
+// matrix in the text format of autoencoder::dump_mat, one row per line
+MatrixXd load_mat(const string & filename);
+
+// patch files in the trainer's text format: every line holds dim values,
+// optionally followed by an integer label (-1 when absent). A directory
+// stands for its files in name order
+vector<string> sample_files(const string & path);
+void load_samples(const string & filename, int dim, MatrixXd & x, vector<int> & labels);
+
+// encoder half of a stack dumped by autoencoder::dump_result, the
+// ae_layer_<l>_W1 and ae_layer_<l>_b1 files of a model directory
+class ae_model {
+ public:
+  // n_lyr < 0 loads every layer found in dir
+  ae_model(const string & dir, const string & acti_func_type = "sigmoid", int n_lyr = -1);
+
+  int n_layers() const { return W.size(); }
+  int in_size() const { return W.empty() ? 0 : W[0].cols(); }
+  int out_size(int n = -1) const;
+
+  // codes of the samples (one per column) after the first n layers, all
+  // of them when n < 0
+  MatrixXd encode(const MatrixXd & x, int n = -1) const;
+  void acti_apply(Eigen::Ref<MatrixXd>) const;
+
+  const MatrixXd & weight(int lyr) const { return W[lyr]; }
+  const VectorXd & bias(int lyr) const { return b[lyr]; }
+
+ private:
+  vector<MatrixXd> W;
+  vector<VectorXd> b;
+  string acti_func_type;
+};
+
+// features of songs, one per column. A song is per consecutive patches of
+// a file; its features are the mean of the codes of its patches, or all
+// of them one after the other when concat is set. The label of a song is
+// that of its first patch and where tells "file:line" of that patch
+struct song_set {
+  MatrixXd x;
+  vector<int> labels;
+  vector<string> where;
+};
+
+// the files are encoded on n_threads threads, the songs stay in file order.
+// A short last song of a file is averaged over the patches it has, or
+// dropped under concat
+song_set encode_songs(const ae_model & model, const vector<string> & files, int dim,
+                      int per, bool concat, int n_threads);
+
+} // namespace paracel
+
+#endif
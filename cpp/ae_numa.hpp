@@ -0,0 +1,152 @@
+#ifndef _AE_NUMA_HPP_
+#define _AE_NUMA_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace paracel{
+
+struct numa_node {
+  int id;
+  std::vector<int> cpus;
+};
+
+// "0-3,8-11" -> {0, 1, 2, 3, 8, 9, 10, 11}
+inline std::vector<int> parse_cpulist(const std::string & s) {
+  std::vector<int> cpus;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty() || item[0] == '\n') continue;
+    size_t dash = item.find('-');
+    int lo = std::atoi(item.c_str());
+    int hi = dash == std::string::npos ? lo : std::atoi(item.c_str() + dash + 1);
+    for (int c = lo; c <= hi; c++) {
+      cpus.push_back(c);
+    }
+  }
+  return cpus;
+}
+
+// cpus the calling thread may run on
+inline std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+      if (CPU_ISSET(c, &set)) cpus.push_back(c);
+    }
+  }
+  return cpus;
+}
+
+// NUMA nodes in id order with the allowed cpus of each, nodes left without
+// cpus are skipped. Without sysfs node entries every cpu is one node 0
+inline std::vector<numa_node> numa_nodes(const std::string & root = "/sys/devices/system/node") {
+  std::vector<int> allowed = allowed_cpus();
+  std::vector<numa_node> nodes;
+  if (DIR * dp = opendir(root.c_str())) {
+    while (struct dirent * e = readdir(dp)) {
+      std::string name(e->d_name);
+      if (name.compare(0, 4, "node") || name.size() == 4 ||
+          name.find_first_not_of("0123456789", 4) != std::string::npos) {
+        continue;
+      }
+      std::ifstream is(root + "/" + name + "/cpulist");
+      std::string list;
+      std::getline(is, list);
+      numa_node nd;
+      nd.id = std::atoi(name.c_str() + 4);
+      for (int c : parse_cpulist(list)) {
+        if (std::binary_search(allowed.begin(), allowed.end(), c)) nd.cpus.push_back(c);
+      }
+      if (nd.cpus.size()) nodes.push_back(nd);
+    }
+    closedir(dp);
+  }
+  if (nodes.empty()) {
+    numa_node nd;
+    nd.id = 0;
+    nd.cpus = allowed;
+    nodes.push_back(nd);
+  }
+  std::sort(nodes.begin(), nodes.end(),
+            [] (const numa_node & a, const numa_node & b) { return a.id < b.id; });
+  return nodes;
+}
+
+// nodes and cpus of local rank r out of n ranks on a host. Ranks go to the
+// nodes in contiguous blocks and split the cpus of their node evenly; with
+// fewer ranks than nodes a rank takes several whole nodes
+inline void numa_place(const std::vector<numa_node> & nodes, int r, int n,
+                       std::vector<int> & node_ids, std::vector<int> & cpus) {
+  int nn = nodes.size();
+  node_ids.clear();
+  cpus.clear();
+  if (n <= nn) {
+    for (int k = r * nn / n; k < (r + 1) * nn / n; k++) {
+      node_ids.push_back(nodes[k].id);
+      cpus.insert(cpus.end(), nodes[k].cpus.begin(), nodes[k].cpus.end());
+    }
+    return;
+  }
+  int k = r * nn / n;
+  int first = (k * n + nn - 1) / nn;  // ranks [first, last) share node k
+  int last = ((k + 1) * n + nn - 1) / nn;
+  int j = r - first, share = last - first;
+  const std::vector<int> & c = nodes[k].cpus;
+  int lo = j * c.size() / share, hi = (j + 1) * c.size() / share;
+  if (lo == hi) {  // more ranks than cpus
+    cpus.push_back(c[lo % c.size()]);
+  } else {
+    cpus.assign(c.begin() + lo, c.begin() + hi);
+  }
+  node_ids.push_back(nodes[k].id);
+}
+
+// restrict the calling thread, and the threads it creates later, to cpus
+inline bool pin_cpus(const std::vector<int> & cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : cpus) {
+    CPU_SET(c, &set);
+  }
+  return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// pages first touched from now on are spread round-robin over nodes; only
+// meant for a rank that spans several nodes
+inline bool interleave_nodes(const std::vector<int> & node_ids) {
+  const int mpol_interleave = 3;  // MPOL_INTERLEAVE of numaif.h
+  unsigned long mask[16] = {0};
+  for (int id : node_ids) {
+    mask[id / (8 * sizeof(long))] |= 1UL << (id % (8 * sizeof(long)));
+  }
+  return syscall(SYS_set_mempolicy, mpol_interleave, mask, 8 * sizeof(mask)) == 0;
+}
+
+// {0, 1, 2, 5} -> "0-2,5"
+inline std::string cpus_str(const std::vector<int> & cpus) {
+  std::string s;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j+1] == cpus[j] + 1) j++;
+    s += (s.empty() ? "" : ",") + std::to_string(cpus[i]);
+    if (j > i) s += "-" + std::to_string(cpus[j]);
+    i = j;
+  }
+  return s;
+}
+
+} // namespace paracel
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _AE_RING_HPP_
+#define _AE_RING_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <mpi.h>
+
+namespace paracel{
+
+// In place sum of buf[0, n) over all ranks of comm along a ring: a
+// reduce-scatter leaves segment (r + 1) % p fully summed on rank r, an
+// allgather passes the summed segments round. Every rank sends and
+// receives 2 (p - 1) / p of the buffer whatever p is, so the time is
+// bounded by the slowest link instead of by the fan-in of one root.
+// A segment travels in messages of at most chunk doubles; the receive of
+// the next chunk is posted before the current one is added in, which
+// overlaps the adds with the transfer.
+inline void ring_allreduce(double * buf, size_t n, MPI_Comm comm, size_t chunk = 65536) {
+  int p, r;
+  MPI_Comm_size(comm, &p);
+  MPI_Comm_rank(comm, &r);
+  if (p == 1 || n == 0) {
+    return;
+  }
+  const int tag = 0x4145;
+  int right = (r + 1) % p, left = (r + p - 1) % p;
+  chunk = std::max(chunk, size_t(1));
+  auto seg_st = [&] (int k) { return size_t(k) * n / p; };
+  auto seg_len = [&] (int k) { return size_t(k + 1) * n / p - size_t(k) * n / p; };
+  auto n_chunks = [&] (size_t len) { return int((len + chunk - 1) / chunk); };
+
+  size_t cb = std::min(chunk, n / p + 1);  // no message is longer
+  std::vector<double> tmp(2 * cb);
+  std::vector<MPI_Request> sends;
+  for (int s = 0; s < p - 1; s++) {
+    int ks = (r - s + p) % p, kr = (r - s - 1 + p) % p;
+    size_t ss = seg_st(ks), sl = seg_len(ks), rs = seg_st(kr), rl = seg_len(kr);
+    sends.resize(n_chunks(sl));
+    for (int c = 0; c < (int)sends.size(); c++) {
+      size_t off = c * chunk;
+      MPI_Isend(buf + ss + off, std::min(chunk, sl - off), MPI_DOUBLE, right, tag, comm, &sends[c]);
+    }
+    int nc = n_chunks(rl);
+    MPI_Request recv[2];
+    if (nc) {
+      MPI_Irecv(&tmp[0], std::min(chunk, rl), MPI_DOUBLE, left, tag, comm, &recv[0]);
+    }
+    for (int c = 0; c < nc; c++) {
+      size_t off = c * chunk, len = std::min(chunk, rl - off);
+      if (c + 1 < nc) {
+        size_t nxt = (c + 1) * chunk;
+        MPI_Irecv(&tmp[((c + 1) % 2) * cb], std::min(chunk, rl - nxt), MPI_DOUBLE, left, tag,
+                  comm, &recv[(c + 1) % 2]);
+      }
+      MPI_Wait(&recv[c % 2], MPI_STATUS_IGNORE);
+      const double * in = &tmp[(c % 2) * cb];
+      double * out = buf + rs + off;
+      for (size_t j = 0; j < len; j++) {
+        out[j] += in[j];
+      }
+    }
+    // the segment summed here is the one sent on the next step
+    MPI_Waitall(sends.size(), sends.data(), MPI_STATUSES_IGNORE);
+  }
+  std::vector<MPI_Request> reqs;
+  for (int s = 0; s < p - 1; s++) {
+    int ks = (r + 1 - s + p) % p, kr = (r - s + p) % p;
+    size_t ss = seg_st(ks), sl = seg_len(ks), rs = seg_st(kr), rl = seg_len(kr);
+    reqs.clear();
+    reqs.resize(n_chunks(sl) + n_chunks(rl));
+    int q = 0;
+    for (size_t off = 0; off < rl; off += chunk) {
+      MPI_Irecv(buf + rs + off, std::min(chunk, rl - off), MPI_DOUBLE, left, tag, comm, &reqs[q++]);
+    }
+    for (size_t off = 0; off < sl; off += chunk) {
+      MPI_Isend(buf + ss + off, std::min(chunk, sl - off), MPI_DOUBLE, right, tag, comm, &reqs[q++]);
+    }
+    MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+  }
+}
+
+} // namespace paracel
+
+#endif
@@ -0,0 +1,150 @@
+// Heap allocations and time per step of the per-sample routines once the
+// training loop is warm. Every step of sgd, mini-batch sgd, hogwild and the
+// cost pass must make 0 allocations, otherwise the exit status is 1; the
+// data is random and no servers are needed.
+//   mpirun -np 1 alloc_bench [--hidden 200 --visible 513 ...]
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <functional>
+#include <cstdlib>
+#include <cerrno>
+
+#include <mpi.h>
+#include <google/gflags.h>
+
+#include "ae.hpp"
+
+DEFINE_int32(visible, 513, "input dimension.\n");
+
+DEFINE_int32(hidden, 200, "hidden units.\n");
+
+DEFINE_int32(samples, 2000, "random samples, also the samples of the cost pass.\n");
+
+DEFINE_int32(mibt_size, 16, "mini-batch size.\n");
+
+DEFINE_int32(steps, 2000, "measured steps per routine.\n");
+
+DEFINE_double(dropout, 0., "dropout of hidden units.\n");
+
+DEFINE_double(beta, 0., "sparse penalty.\n");
+
+DEFINE_bool(tied, false, "tied weights.\n");
+
+// every malloc of the process is counted; glibc only, the replacements
+// forward to its internal entry points
+static long n_alloc = 0;
+
+extern "C" {
+void * __libc_malloc(size_t);
+void * __libc_calloc(size_t, size_t);
+void * __libc_realloc(void *, size_t);
+void * __libc_memalign(size_t, size_t);
+
+void * malloc(size_t n) { n_alloc++; return __libc_malloc(n); }
+void * calloc(size_t n, size_t sz) { n_alloc++; return __libc_calloc(n, sz); }
+void * realloc(void * p, size_t n) { n_alloc++; return __libc_realloc(p, n); }
+int posix_memalign(void ** p, size_t align, size_t n) {
+  n_alloc++;
+  *p = __libc_memalign(align, n);
+  return *p ? 0 : ENOMEM;
+}
+}
+
+namespace paracel {
+
+class alloc_probe : public autoencoder {
+ public:
+  using autoencoder::autoencoder;
+
+  // false when a routine allocates after its warm-up
+  bool run() {
+    data = MatrixXd::Random(FLAGS_visible, FLAGS_samples).cwiseAbs();
+    if (FLAGS_beta != 0) {
+      rho_init(0);
+    }
+    unordered_map<string, MatrixXd> grad, delta;
+    for (auto & kv : WgtBias[0]) {
+      delta[kv.first] = MatrixXd::Zero(kv.second.rows(), kv.second.cols());
+    }
+    vector<int> batch(FLAGS_mibt_size);
+    int cur = 0;
+    auto next = [&] () { cur = (cur + 97) % FLAGS_samples; return cur; };
+
+    std::cout << std::setw(10) << "routine" << std::setw(14) << "allocs/step"
+              << std::setw(14) << "us/step" << std::endl;
+    bool ok = true;
+    ok &= measure("sgd", FLAGS_steps, [&] () {
+      ae_stoc_grad(0, next(), grad);
+      apply_step(0, grad, delta);
+    });
+    ok &= measure("mbsgd", FLAGS_steps, [&] () {
+      for (auto & i : batch) {
+        i = next();
+      }
+      ae_mibt_stoc_grad(0, batch, grad);
+      apply_step(0, grad, delta);
+    });
+    ok &= measure("hogwild", FLAGS_steps, [&] () {
+      ae_stoc_update(0, next(), alpha, delta, rho_est[0]);
+    });
+    ok &= measure("cost", 3, [&] () {
+      ae_cost(0);
+    });
+    return ok;
+  }
+
+ private:
+  // one untimed warm-up pass sizes every buffer, then steps are counted
+  bool measure(const string & name, int steps, std::function<void()> step) {
+    for (int s = 0; s < steps; s++) {
+      step();
+    }
+    long n0 = n_alloc;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+      step();
+    }
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << std::setw(10) << name << std::setw(14) << double(n_alloc - n0) / steps
+              << std::setw(14) << t / steps * 1e6 << std::endl;
+    return n_alloc == n0;
+  }
+};
+
+} // namespace paracel
+
+
+int main(int argc, char *argv[])
+{
+  paracel::main_env comm_main_env(argc, argv);
+  paracel::Comm comm(MPI_COMM_WORLD);
+
+  google::SetUsageMessage("[options]\n\t--visible\n\t--hidden\n\t--samples\n\t--mibt_size\n\t--steps\n\t--dropout\n\t--beta\n\t--tied\n");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  paracel::ae_options opt;
+  opt.hidden_size = std::vector<int>{FLAGS_hidden};
+  opt.visible_size = FLAGS_visible;
+  // the routines measured do not depend on the method, this one runs
+  // without servers
+  opt.learning_method = "armbsgd";
+  opt.servers = false;
+  opt.lamb = 0.0001;
+  opt.sparsity_param = 0.05;
+  opt.beta = FLAGS_beta;
+  opt.mibt_size = FLAGS_mibt_size;
+  opt.read_batch = 1;
+  opt.update_batch = 1;
+  opt.sparse_thld = 0.1;
+  opt.tied = FLAGS_tied;
+  opt.dropout = FLAGS_dropout;
+  paracel::alloc_probe probe(comm, "", opt);
+  if (!probe.run()) {
+    std::cerr << "per-step allocations after warm-up" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,328 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ann_index.hpp"
+
+namespace paracel{
+
+// 64 bytes in front of every index file, so that the arrays behind it
+// stay 8-byte aligned in the mapping
+struct index_header {
+  char magic[8];
+  uint64_t dim, n, nlist, m, ksub, reserved[2];
+};
+
+static const char FLAT_MAGIC[8] = {'A', 'E', 'F', 'L', 'A', 'T', '0', '1'};
+static const char IVFPQ_MAGIC[8] = {'A', 'E', 'I', 'V', 'F', 'P', 'Q', '1'};
+static const size_t BLOCK = 4096;  // stored vectors per GEMM
+
+mmap_file::mmap_file(const std::string & path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "can not open " << path << std::endl;
+    if (fd >= 0) close(fd);
+    return;
+  }
+  sz = st.st_size;
+  void * m = sz ? mmap(nullptr, sz, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (m == MAP_FAILED) {
+    std::cerr << "can not map " << path << std::endl;
+    sz = 0;
+    return;
+  }
+  p = static_cast<const char *>(m);
+}
+
+mmap_file::~mmap_file() {
+  if (p) {
+    munmap(const_cast<char *>(p), sz);
+  }
+}
+
+static const index_header & check_header(const mmap_file & f, const char * magic, const std::string & path) {
+  if (f.size() < sizeof(index_header) || std::memcmp(f.data(), magic, 8)) {
+    std::cerr << path << " is not an index of this kind" << std::endl;
+    exit(-1);
+  }
+  return *reinterpret_cast<const index_header *>(f.data());
+}
+
+template <class T>
+static void write_array(std::ofstream & os, const T * p, size_t n) {
+  os.write(reinterpret_cast<const char *>(p), n * sizeof(T));
+}
+
+// keep the k smallest hits in a max-heap
+static inline void push_hit(std::vector<ann_hit> & heap, size_t k, const ann_hit & h) {
+  if (heap.size() < k) {
+    heap.push_back(h);
+    std::push_heap(heap.begin(), heap.end());
+  } else if (h < heap.front()) {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = h;
+    std::push_heap(heap.begin(), heap.end());
+  }
+}
+
+
+void flat_index::write(const std::string & path, const RowMatrixXf & x, const std::vector<int64_t> & ids) {
+  assert((size_t)x.rows() == ids.size());
+  index_header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, FLAT_MAGIC, 8);
+  h.dim = x.cols();
+  h.n = x.rows();
+  Eigen::VectorXf norm = x.rowwise().squaredNorm();
+  std::ofstream os(path, std::ios::binary);
+  write_array(os, &h, 1);
+  write_array(os, ids.data(), ids.size());
+  write_array(os, norm.data(), norm.size());
+  write_array(os, x.data(), x.size());
+}
+
+flat_index::flat_index(const std::string & path) : file(path) {
+  const index_header & h = check_header(file, FLAT_MAGIC, path);
+  d = h.dim;
+  n = h.n;
+  const char * p = file.data() + sizeof(index_header);
+  id = reinterpret_cast<const int64_t *>(p);
+  norm = reinterpret_cast<const float *>(p + n * sizeof(int64_t));
+  vec = norm + n;
+  assert(file.size() == sizeof(index_header) + n * (sizeof(int64_t) + sizeof(float) * (d + 1)));
+}
+
+ann_result flat_index::search(const RowMatrixXf & q, int k) const {
+  ann_result res(q.rows());
+  const int qb = 256;  // queries per GEMM
+  RowMatrixXf s;
+  for (int q0 = 0; q0 < q.rows(); q0 += qb) {
+    int nq = std::min<int>(qb, q.rows() - q0);
+    auto qs = q.middleRows(q0, nq);
+    Eigen::VectorXf qn = qs.rowwise().squaredNorm();
+    for (size_t st = 0; st < n; st += BLOCK) {
+      size_t len = std::min(BLOCK, n - st);
+      Eigen::Map<const RowMatrixXf> xb(vec + st * d, len, d);
+      s.noalias() = qs * xb.transpose();
+      for (int i = 0; i < nq; i++) {
+        const float * si = s.row(i).data();
+        for (size_t j = 0; j < len; j++) {
+          ann_hit h = {qn(i) - 2 * si[j] + norm[st + j], id[st + j]};
+          push_hit(res[q0 + i], k, h);
+        }
+      }
+    }
+  }
+  for (auto & r : res) {
+    std::sort_heap(r.begin(), r.end());
+  }
+  return res;
+}
+
+
+std::vector<int> nearest(const RowMatrixXf & x, const RowMatrixXf & c) {
+  std::vector<int> a(x.rows());
+  Eigen::VectorXf cn = c.rowwise().squaredNorm();
+  RowMatrixXf s;
+  for (Eigen::Index st = 0; st < x.rows(); st += BLOCK) {
+    Eigen::Index len = std::min<Eigen::Index>(BLOCK, x.rows() - st);
+    s.noalias() = x.middleRows(st, len) * c.transpose();
+    for (Eigen::Index i = 0; i < len; i++) {
+      // |x|^2 is the same for every centroid
+      Eigen::Index best;
+      (cn.transpose() - 2 * s.row(i)).minCoeff(&best);
+      a[st + i] = best;
+    }
+  }
+  return a;
+}
+
+RowMatrixXf kmeans(const RowMatrixXf & x, int k, int iters, unsigned seed) {
+  std::mt19937 rng(seed);
+  int n = x.rows();
+  k = std::min(k, n);
+  std::vector<int> perm(n);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), rng);
+  RowMatrixXf c(k, x.cols());
+  for (int j = 0; j < k; j++) {
+    c.row(j) = x.row(perm[j]);
+  }
+  RowMatrixXf sum(k, x.cols());
+  std::vector<int> cnt(k);
+  for (int it = 0; it < iters; it++) {
+    std::vector<int> a = nearest(x, c);
+    sum.setZero();
+    std::fill(cnt.begin(), cnt.end(), 0);
+    for (int i = 0; i < n; i++) {
+      sum.row(a[i]) += x.row(i);
+      cnt[a[i]] += 1;
+    }
+    for (int j = 0; j < k; j++) {
+      if (cnt[j]) {
+        c.row(j) = sum.row(j) / cnt[j];
+      } else {
+        c.row(j) = x.row(rng() % n);
+      }
+    }
+  }
+  return c;
+}
+
+
+void ivfpq_index::build(const std::string & path, const RowMatrixXf & x, const std::vector<int64_t> & ids,
+                        const ivfpq_params & params) {
+  assert((size_t)x.rows() == ids.size() && x.rows() > 0);
+  size_t n = x.rows();
+  int d = x.cols();
+  int m = std::max(1, std::min(params.m, d));
+  std::vector<int> sub_st(m + 1);
+  for (int j = 0; j <= m; j++) {
+    sub_st[j] = j * d / m;
+  }
+
+  // the quantizers are trained on a sample
+  std::vector<size_t> perm(n);
+  std::iota(perm.begin(), perm.end(), 0);
+  std::shuffle(perm.begin(), perm.end(), std::mt19937(params.seed));
+  size_t nt = std::min(n, std::max(params.n_train, size_t(1)));
+  RowMatrixXf xt(nt, d);
+  for (size_t i = 0; i < nt; i++) {
+    xt.row(i) = x.row(perm[i]);
+  }
+  RowMatrixXf coarse = kmeans(xt, params.nlist, params.iters, params.seed);
+  int nlist = coarse.rows();
+  std::vector<int> at = nearest(xt, coarse);
+  for (size_t i = 0; i < nt; i++) {
+    xt.row(i) -= coarse.row(at[i]);
+  }
+  std::vector<RowMatrixXf> pq(m);
+  for (int j = 0; j < m; j++) {
+    pq[j] = kmeans(xt.middleCols(sub_st[j], sub_st[j+1] - sub_st[j]), 256, params.iters, params.seed + 1 + j);
+  }
+  int ksub = pq[0].rows();
+
+  // code every vector, a block of rows at a time
+  std::vector<int> cell(n);
+  std::vector<uint8_t> code(n * m);
+  for (size_t st = 0; st < n; st += BLOCK) {
+    size_t len = std::min(BLOCK, n - st);
+    RowMatrixXf r = x.middleRows(st, len);
+    std::vector<int> a = nearest(r, coarse);
+    for (size_t i = 0; i < len; i++) {
+      cell[st + i] = a[i];
+      r.row(i) -= coarse.row(a[i]);
+    }
+    for (int j = 0; j < m; j++) {
+      std::vector<int> s = nearest(r.middleCols(sub_st[j], sub_st[j+1] - sub_st[j]), pq[j]);
+      for (size_t i = 0; i < len; i++) {
+        code[(st + i) * m + j] = s[i];
+      }
+    }
+  }
+
+  // entries grouped by cell
+  std::vector<uint64_t> offs(nlist + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    offs[cell[i] + 1] += 1;
+  }
+  std::partial_sum(offs.begin(), offs.end(), offs.begin());
+  std::vector<uint64_t> pos(offs.begin(), offs.end() - 1);
+  std::vector<int64_t> id_sorted(n);
+  std::vector<uint8_t> code_sorted(n * m);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t e = pos[cell[i]]++;
+    id_sorted[e] = ids[i];
+    std::memcpy(&code_sorted[e * m], &code[i * m], m);
+  }
+
+  index_header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, IVFPQ_MAGIC, 8);
+  h.dim = d;
+  h.n = n;
+  h.nlist = nlist;
+  h.m = m;
+  h.ksub = ksub;
+  std::ofstream os(path, std::ios::binary);
+  write_array(os, &h, 1);
+  write_array(os, offs.data(), offs.size());
+  write_array(os, id_sorted.data(), n);
+  write_array(os, coarse.data(), coarse.size());
+  for (int j = 0; j < m; j++) {
+    write_array(os, pq[j].data(), pq[j].size());
+  }
+  write_array(os, code_sorted.data(), code_sorted.size());
+}
+
+ivfpq_index::ivfpq_index(const std::string & path) : file(path) {
+  const index_header & h = check_header(file, IVFPQ_MAGIC, path);
+  d = h.dim;
+  n = h.n;
+  nlist = h.nlist;
+  m = h.m;
+  ksub = h.ksub;
+  const char * p = file.data() + sizeof(index_header);
+  offs = reinterpret_cast<const uint64_t *>(p);
+  id = reinterpret_cast<const int64_t *>(offs + nlist + 1);
+  coarse = reinterpret_cast<const float *>(id + n);
+  pq = coarse + size_t(nlist) * d;
+  codes = reinterpret_cast<const uint8_t *>(pq + size_t(ksub) * d);
+  assert((const char *)(codes + n * m) == file.data() + file.size());
+  sub_st.resize(m + 1);
+  for (int j = 0; j <= m; j++) {
+    sub_st[j] = j * d / m;
+  }
+  coarse_norm = Eigen::Map<const RowMatrixXf>(coarse, nlist, d).rowwise().squaredNorm();
+}
+
+ann_result ivfpq_index::search(const RowMatrixXf & q, int k, int nprobe) const {
+  ann_result res(q.rows());
+  Eigen::Map<const RowMatrixXf> C(coarse, nlist, d);
+  nprobe = std::max(1, std::min(nprobe, nlist));
+  std::vector<float> lut(size_t(m) * ksub);
+  std::vector<std::pair<float, int> > cd(nlist);
+  Eigen::VectorXf qc(nlist);
+  Eigen::RowVectorXf r(d);
+  for (int i = 0; i < q.rows(); i++) {
+    qc.noalias() = C * q.row(i).transpose();
+    for (int c = 0; c < nlist; c++) {
+      cd[c] = std::make_pair(coarse_norm(c) - 2 * qc(c), c);
+    }
+    std::partial_sort(cd.begin(), cd.begin() + nprobe, cd.end());
+    std::vector<ann_hit> & heap = res[i];
+    for (int pb = 0; pb < nprobe; pb++) {
+      int c = cd[pb].second;
+      r = q.row(i) - C.row(c);
+      // lut[j][s] = |r_j - pq_j[s]|^2
+      for (int j = 0; j < m; j++) {
+        int len = sub_st[j+1] - sub_st[j];
+        Eigen::Map<const RowMatrixXf> P(pq + size_t(ksub) * sub_st[j], ksub, len);
+        Eigen::Map<Eigen::VectorXf> l(&lut[size_t(j) * ksub], ksub);
+        l = (P.rowwise() - r.segment(sub_st[j], len)).rowwise().squaredNorm();
+      }
+      for (uint64_t e = offs[c]; e < offs[c+1]; e++) {
+        const uint8_t * ce = codes + e * m;
+        float dist = 0;
+        for (int j = 0; j < m; j++) {
+          dist += lut[j * ksub + ce[j]];
+        }
+        push_hit(heap, k, ann_hit{dist, id[e]});
+      }
+    }
+    std::sort_heap(heap.begin(), heap.end());
+  }
+  return res;
+}
+
+} // namespace paracel
@@ -0,0 +1,111 @@
+#ifndef _ANN_INDEX_HPP_
+#define _ANN_INDEX_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <eigen3/Eigen/Dense>
+
+namespace paracel{
+
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrixXf;
+
+// read-only view of a whole file through mmap; pages are only read in
+// when a search touches them
+class mmap_file {
+ public:
+  explicit mmap_file(const std::string & path);
+  ~mmap_file();
+  mmap_file(const mmap_file &) = delete;
+  mmap_file & operator=(const mmap_file &) = delete;
+
+  const char * data() const { return p; }
+  size_t size() const { return sz; }
+
+ private:
+  const char * p = nullptr;
+  size_t sz = 0;
+};
+
+struct ann_hit {
+  float dist;  // squared L2
+  int64_t id;
+  bool operator<(const ann_hit & o) const { return dist < o.dist || (dist == o.dist && id < o.id); }
+};
+
+// the k nearest of every query, nearest first
+typedef std::vector<std::vector<ann_hit> > ann_result;
+
+// Exact search. Vectors are stored row-major in float next to their
+// squared norms. A block of queries is scored against a block of stored
+// vectors as one GEMM, which Eigen runs on its SIMD kernels, and
+// |q - x|^2 = |q|^2 - 2 q.x + |x|^2
+class flat_index {
+ public:
+  static void write(const std::string & path, const RowMatrixXf & x, const std::vector<int64_t> & ids);
+  explicit flat_index(const std::string & path);
+
+  int dim() const { return d; }
+  size_t size() const { return n; }
+  Eigen::Map<const RowMatrixXf> vectors() const { return Eigen::Map<const RowMatrixXf>(vec, n, d); }
+  const int64_t * ids() const { return id; }
+
+  ann_result search(const RowMatrixXf & q, int k) const;
+
+ private:
+  mmap_file file;
+  int d;
+  size_t n;
+  const int64_t * id;
+  const float * norm;
+  const float * vec;
+};
+
+// IVF-PQ: k-means cells over the vectors, and the residual of a vector to
+// its cell centroid cut into m sub-vectors, each stored as the byte id of
+// the nearest of 256 sub-centroids. A query scans the stored codes of its
+// nprobe nearest cells with one table of sub-distances per cell
+struct ivfpq_params {
+  int nlist = 1024;
+  int m = 8;
+  int iters = 20;
+  size_t n_train = 65536;  // vectors sampled for k-means
+  unsigned seed = 1;
+};
+
+class ivfpq_index {
+ public:
+  static void build(const std::string & path, const RowMatrixXf & x, const std::vector<int64_t> & ids,
+                    const ivfpq_params & params);
+  explicit ivfpq_index(const std::string & path);
+
+  int dim() const { return d; }
+  size_t size() const { return n; }
+  int n_list() const { return nlist; }
+  size_t bytes_per_vector() const { return m + sizeof(int64_t); }
+
+  ann_result search(const RowMatrixXf & q, int k, int nprobe) const;
+
+ private:
+  mmap_file file;
+  int d, nlist, m, ksub;
+  size_t n;
+  const uint64_t * offs;  // cell c holds entries [offs[c], offs[c+1])
+  const int64_t * id;
+  const float * coarse;
+  const float * pq;
+  const uint8_t * codes;
+  std::vector<int> sub_st;  // first dimension of every sub-vector, m + 1 entries
+  Eigen::VectorXf coarse_norm;
+};
+
+// Lloyd's k-means on the rows of x, centroids as rows. Empty clusters are
+// reseeded from a random row
+RowMatrixXf kmeans(const RowMatrixXf & x, int k, int iters, unsigned seed);
+
+// index of the nearest row of c for every row of x
+std::vector<int> nearest(const RowMatrixXf & x, const RowMatrixXf & c);
+
+} // namespace paracel
+
+#endif
@@ -1,4 +1,6 @@
-#include "fine_tn.hpp" 
+#include "fine_tn.hpp"
+#include <algorithm>
+#include <iostream>
 #include <cmath>
 #include <cassert>
 
@@ -6,24 +8,18 @@ vector<int> GID{331, 335, 325, 337, 328, 334, 336, 327, 326, 332, 333, 324, 329,
 
 namespace paracel{
 
-fine_tune::fine_tune(paracel::Comm comm, string hosts_dct_str,
-          string _input, string _output, vector<int> _hidden_size,
-          int _visible_size, vector<unordered_map<string, MatrixXd> > _WgtBias,
-          string method, string _acti_func_type, 
-          int _rounds, double _alpha, bool _debug, int limit_s, 
-          bool ssp_switch, double _lamb, double _sparsity_param, 
-          double _beta, int _mibt_size, int _read_batch, int _update_batch,
-          int _n_class):
-      autoencoder(comm, hosts_dct_str, _input, _output, 
-                  _hidden_size, _visible_size, method, 
-                  _acti_func_type, _rounds, _alpha, _debug, 
-                  limit_s, ssp_switch, _lamb, _sparsity_param, 
-                  _beta, _mibt_size, _read_batch, _update_batch),
-      input(_input),
-      output(_output),
-      n_class(_n_class) {
-        WgtBias = _WgtBias;
-        //smx_init();
+fine_tune::fine_tune(paracel::Comm comm, string hosts_dct_str, const ae_options & opt,
+          const vector<unordered_map<string, MatrixXd> > & _WgtBias,
+          int _n_class, int _n_frozen, string _grad_check):
+      autoencoder(comm, hosts_dct_str, opt, _WgtBias),
+      input(opt.input),
+      output(opt.output),
+      n_class(_n_class),
+      n_frozen(_n_frozen),
+      grad_check(_grad_check) {
+        assert(n_class == (int)GID.size());
+        assert(n_frozen >= 0 && n_frozen < n_lyr);
+        acti_cache.resize(n_lyr);
       }
 
 fine_tune::~fine_tune() {}
@@ -31,159 +27,410 @@ fine_tune::~fine_tune() {}
 
 void fine_tune::smx_init(){
   // randomly generate smx_W $ smx_b
-  assert(data_top.rows() != 0 && "We don't have data_top yet\n");
-  smx_W = MatrixXd::Random(n_class, data_top.rows());
-  // process labels.
-  for(auto it = labels.begin(); it != labels.end(); it++) {
-    auto pos = std::find(GID.begin(), GID.end(), *it);
-    assert(pos != GID.end());
-    *it = pos - GID.begin();
-  }
-  data_lbl = VectorXd::Map(&labels[0], labels.size());
+  assert(n_cached == n_lyr && "We don't have data_top yet\n");
+  smx_W = MatrixXd::Random(n_class, data_top().rows());
 }
 
 
-vector<vector<double> > fine_tune::smx_prob(MatrixXd & theta) const{
-  MatrixXd prob;
-  assert(theta.rows() == n_class)
-  assert(theta.cols() == data_top.rows())
-  ArrayXXd prob_tmp = (theta * data_top).array();
-  prob = (exp(prob_tmp)).matrix();
-  MatrixXd norm_fact = prob.colwise().sum();
-  for (i = 0; i < prob.rows(); i++) {
-    prob.row(i) = (prob.row(i).array() / norm_fact.array()).matrix();
-  }
+// column-wise softmax of theta * x, shifted by the column max so that exp
+// never overflows
+MatrixXd fine_tune::smx_prob(const MatrixXd & theta, const MatrixXd & x) const{
+  assert(theta.rows() == n_class);
+  assert(theta.cols() == x.rows());
+  MatrixXd prob = theta * x;
+  prob.rowwise() -= prob.colwise().maxCoeff();
+  prob = prob.array().exp().matrix();
+  prob.array().rowwise() /= prob.colwise().sum().array();
   return prob;
 }
 
 
-double fine_tune::smx_cost(MatrixXd & prob) const{
-  assert(prob.cols() == data_top.cols());
+// -1/m sum log p(y|x) evaluated by log-sum-exp, no log of a rounded prob;
+// logit is shifted in place, sq_norm is |theta|^2 for the weight decay
+double fine_tune::smx_cost_logit(MatrixXd & logit, double sq_norm) const{
+  logit.rowwise() -= logit.colwise().maxCoeff();
+  Eigen::ArrayXXd lse = logit.array().exp().colwise().sum().log();
   double cost = 0;
-  MatrixXd lbl = MatrixXd::Zero(data_top.cols(), n_class);
-  for (int i = 0; i < lbl.rows(); i++) {
-    lbl(i, data_lbl(i)) = 1;
+  for (int i = 0; i < logit.cols(); i++) {
+    cost += lse(0, i) - logit(data_lbl[i], i);
   }
-  MatrixXd cost_array = lbl * (log(prob.array())).matrix();
-  cost = cost_array.trace();
-  cost *= -1. / data_top.cols();
+  cost /= logit.cols();
+  cost += lamb / 2. * sq_norm;
   return cost;
 }
 
 
-vector<unordered_map<string, MatrixXd> > fine_tune::smx_grad(MatrixXd & prob) const{
-  assert(prob.cols() == data_top.cols());
-  MatrixXd lbl = MatrixXd::Zero(data_top.cols(), n_class);
-  for (int i = 0; i < lbl.rows(); i++) {
-    lbl(i, data_lbl(i)) = 1;
+double fine_tune::smx_cost(const MatrixXd & theta) const{
+  MatrixXd logit = theta * data_top();
+  return smx_cost_logit(logit, theta.squaredNorm());
+}
+
+
+MatrixXd fine_tune::smx_grad(const MatrixXd & theta) const{
+  MatrixXd prob = smx_prob(theta, data_top());
+  for (int i = 0; i < prob.cols(); i++) {
+    prob(data_lbl[i], i) -= 1.;
   }
-  lbl = lbl.transpose() - prob;
-  MatrixXd grad = lbl * data_top.transpose();
-  grad = (grad.array() * -1. / data_top.cols()).matrix();
+  MatrixXd grad = prob * data_top().transpose();
+  grad = (grad.array() / data_top().cols() + lamb * theta.array()).matrix();
   return grad;
 }
 
 
-void fine_tune::smx_nume_grad() {
-  // Reload data? // TODO, not printing these shit.
-  std::cout << get_worker_id() <<"printing" << std::endl;
-  std::cout << data.rows() << std::endl;
-  std::cout << data.cols() << std::endl;
-  std::cout << get_worker_id() << "printing done" << std::endl;
-
-  std::cout << "Check gradients computing" << std::endl;
-  MatrixXd nume_grad = MatrixXd::Zero(smx_W.rows(), smx_W.cols());
-  for (int i = 0; i < smx_W.rows(); i++) {
-    for (int j = 0; j < smx_cols(); j++) {
-      MatrixXd smx_w_nume1 = smx_W;
-      MatrixXd smx_w_nume2 = smx_W;
-      smx_W_nume1(i, j) += 1e-4;
-      smx_W_nume2(i, j) -= 1e-4;
-      MatrixXd prob1 = smx_prob(smx_W_nume1);
-      MatrixXd prob2 = smx_prob(smx_W_nume2);
-      nume_grad(i, j) = smx_cost(prob1) - smx_cost(prob2);
-      nume_grad(i, j) /= 2 * 1e-4;
+// "directional" compares the derivative along n_check random directions,
+// two cost evaluations each. "sampled" checks n_check random entries and
+// "full" every entry; both perturb one row of the cached logits instead of
+// recomputing theta * data_top.
+void fine_tune::smx_nume_grad(string mode, int n_check) {
+  std::cout << "Check gradients computing (" << mode << ")" << std::endl;
+  if (n_cached < n_lyr) {
+    fn_cost();
+  }
+  const double eps = 1e-4;
+  MatrixXd grad = smx_grad(smx_W);
+  if (mode == "directional") {
+    double err = 0, nrm = 0;
+    for (int k = 0; k < n_check; k++) {
+      MatrixXd dir = MatrixXd::Random(smx_W.rows(), smx_W.cols());
+      dir /= dir.norm();
+      double nume = (smx_cost(smx_W + eps * dir) - smx_cost(smx_W - eps * dir)) / (2 * eps);
+      double ana = (grad.array() * dir.array()).sum();
+      err += (nume - ana) * (nume - ana);
+      nrm += (nume + ana) * (nume + ana);
     }
+    std::cout << sqrt(err / nrm) << std::endl;
+  } else {
+    vector<std::pair<int, int> > entries;
+    for (int i = 0; i < smx_W.rows(); i++) {
+      for (int j = 0; j < smx_W.cols(); j++) {
+        entries.push_back(std::make_pair(i, j));
+      }
+    }
+    if (mode == "sampled" && n_check < (int)entries.size()) {
+      std::random_shuffle(entries.begin(), entries.end());
+      entries.resize(n_check);
+    }
+    const MatrixXd & x = data_top();
+    MatrixXd logit = smx_W * x;
+    double sq_norm = smx_W.squaredNorm();
+    VectorXd nume(entries.size()), ana(entries.size());
+    for (size_t k = 0; k < entries.size(); k++) {
+      int i = entries[k].first, j = entries[k].second;
+      double w = smx_W(i, j);
+      MatrixXd logit1 = logit, logit2 = logit;
+      logit1.row(i) += eps * x.row(j);
+      logit2.row(i) -= eps * x.row(j);
+      double sq1 = sq_norm - w * w + (w + eps) * (w + eps);
+      double sq2 = sq_norm - w * w + (w - eps) * (w - eps);
+      nume(k) = (smx_cost_logit(logit1, sq1) - smx_cost_logit(logit2, sq2)) / (2 * eps);
+      ana(k) = grad(i, j);
+    }
+    std::cout << (ana - nume).norm() / (ana + nume).norm() << std::endl;
   }
-  prob = smx_prob(smx_W);
-  grad = smx_grad(prob);
-  std::cout << (grad - nume_grad).norm() / \
-               (grad + nume_grad).norm() << std::endl;
   std::cout << "Values printed above should be less than 1e-9" << std::endl;
 }
 
 
-double fine_tune::fn_cost() const{
-  double cost = 0;
-  int n_lyr = WgtBias.size(); //
-  MatrixXd data_lyr = data;
-  for (int i = 0; i < n_lyr; i++) {
-    data_lyr = acti_func(WgtBias[i].at("W1") * data_lyr + \
-                         WgtBias[i].at("b1"));
+// raw input and labels, since the pretraining solver only keeps the
+// activations of its top layer
+void fine_tune::fn_load(){
+  auto lines = load_lines(todir(input));
+  local_parser(lines, ' ', true); // includes label
+  data = vec_to_mat(samples).transpose();
+  samples.resize(0);
+  lines.resize(0);
+  // samples whose label is not in GID are reported and dropped
+  data_lbl.resize(0);
+  int n = 0, n_unknown = 0;
+  for (size_t k = 0; k < labels.size(); k++) {
+    auto pos = std::find(GID.begin(), GID.end(), labels[k]);
+    if (pos == GID.end()) {
+      n_unknown += 1;
+      continue;
+    }
+    if (n != (int)k) {
+      data.col(n) = data.col(k);
+    }
+    data_lbl.push_back(pos - GID.begin());
+    n += 1;
+  }
+  if (n_unknown) {
+    std::cerr << "worker" << get_worker_id() << " skipped " << n_unknown << " samples whose label is not in GID" << std::endl;
+    data.conservativeResize(Eigen::NoChange, n);
+  }
+}
+
+
+// recompute only the layers above the last up-to-date activation
+void fine_tune::fn_propagate(){
+  for (int i = n_cached; i < n_lyr; i++) {
+    const MatrixXd & data_lyr = (i == 0) ? data : acti_cache[i-1];
+    acti_cache[i] = acti_func((WgtBias[i].at("W1") * data_lyr).colwise() + \
+                              WgtBias[i].at("b1").col(0));
   }
-  if(data_top.rows() == 0){ // not initialize softmax
+  n_cached = n_lyr;
+}
+
+
+double fine_tune::fn_cost(){
+  fn_propagate();
+  if(smx_W.rows() == 0){ // not initialize softmax
     smx_init();
   }
-  data_top = data_lyr;
-  cost = smx_cost(smx_prob(smx_W)); // TODO, add some asserts
-  return cost;
+  return smx_cost(smx_W);
+}
+
+
+MatrixXd fine_tune::gather_cols(const MatrixXd & src, const vector<int> & index_data) const{
+  MatrixXd x(src.rows(), index_data.size());
+  for (size_t j = 0; j < index_data.size(); j++) {
+    x.col(j) = src.col(index_data[j]);
+  }
+  return x;
 }
 
 
 vector<unordered_map<string, MatrixXd> > fine_tune::fn_stoc_grad(int idx) const{
-  vector<unordered_map<string, MatrixXd> > WgtBiasGrad;
-  int n_lyr = WgtBias.size();
-  for (int i = 0; i < n_lyr; i++) {
-    // initialize
-    unordered_map<string, MatrixXd> grad_elem;
-    grad_elem["W1"] = MatrixXd::Random(WgtBias[i].at("W1").rows(), WgtBias[i].at("W1").cols());
-    grad_elem["b1"] = MatrixXd::Random(WgtBias[i].at("b1").rows(), WgtBias[i].at("b1").cols());
-    WgtBiasGrad.push_back(grad_elem);
-  } 
-  WgtBiasGrad;
-  unordered_map<int, MatrixXd> a;
-  unordered_map<int, MatrixXd> z;
-  unordered_map<int, MatrixXd> sigma; // grad elements
-  a[1] = data.col(idx);
-  for (int i = 1; i < n_lyr; i++) {
-      // not i TODO
-    z[i+1] = WgtBias[i].at("W1") * a[i] + WgtBias[i].at("b1");
-    a[i+1] = acti_func(z[i+1]);
+  return fn_mibt_stoc_grad(vector<int>(1, idx));
+}
+
+
+// back-propagation through the softmax and every trainable encoder layer,
+// one GEMM per layer and direction for the whole mini-batch. The forward
+// pass starts from the cached output of the frozen layers, whose entries
+// in the result stay empty. Entry n_lyr holds the softmax gradient "W".
+vector<unordered_map<string, MatrixXd> > fine_tune::fn_mibt_stoc_grad(const vector<int> & index_data) const{
+  assert(n_cached >= n_frozen);
+  int m = index_data.size();
+  vector<MatrixXd> a(n_lyr + 1);
+  a[n_frozen] = gather_cols(n_frozen == 0 ? data : acti_cache[n_frozen-1], index_data);
+  // with dropout every hidden column of a trainable layer gets its own
+  // bit-packed mask, fused with the activation
+  vector<vector<uint64_t> > mask(n_lyr + 1);
+  vector<int> kept;
+  for (int i = n_frozen; i < n_lyr; i++) {
+    a[i+1] = (WgtBias[i].at("W1") * a[i]).colwise() + WgtBias[i].at("b1").col(0);
+    if (dropout > 0) {
+      int nw = drop_words(a[i+1].rows());
+      mask[i+1].resize(nw * m);
+      for (int j = 0; j < m; j++) {
+        drop_acti(a[i+1].col(j), &mask[i+1][nw * j], kept);
+      }
+    } else {
+      a[i+1] = acti_func(a[i+1]);
+    }
+  }
+  // derivative of layer l through its dropout mask
+  auto acti_der = [&](MatrixXd & sigma, int l) {
+    if (dropout > 0) {
+      sigma = (sigma.array() * acti_func_der(a[l] * drop_keep())).matrix();
+      int nw = drop_words(sigma.rows());
+      for (int j = 0; j < m; j++) {
+        drop_apply(sigma.col(j), &mask[l][nw * j]);
+      }
+    } else {
+      sigma = (sigma.array() * acti_func_der(a[l])).matrix();
+    }
+  };
+  // softmax error
+  MatrixXd sigma = smx_prob(smx_W, a[n_lyr]);
+  for (int j = 0; j < m; j++) {
+    sigma(data_lbl[index_data[j]], j) -= 1.;
+  }
+
+  vector<unordered_map<string, MatrixXd> > WgtBiasGrad(n_lyr + 1);
+  WgtBiasGrad[n_lyr]["W"] = ((sigma * a[n_lyr].transpose()).array() / m + lamb * smx_W.array()).matrix();
+  sigma = smx_W.transpose() * sigma;
+  acti_der(sigma, n_lyr);
+  for (int i = n_lyr - 1; i >= n_frozen; i--) {
+    const MatrixXd & W1 = WgtBias[i].at("W1");
+    WgtBiasGrad[i]["W1"] = ((sigma * a[i].transpose()).array() / m + lamb * W1.array()).matrix();
+    WgtBiasGrad[i]["b1"] = (sigma.rowwise().sum().array() / m).matrix();
+    if (i > n_frozen) {
+      sigma = W1.transpose() * sigma;
+      acti_der(sigma, i);
+    }
+  }
+  return WgtBiasGrad;
+}
+
+
+vector<unordered_map<string, MatrixXd> > fine_tune::fn_zero_like() const{
+  vector<unordered_map<string, MatrixXd> > zero(n_lyr + 1);
+  for (int i = n_frozen; i < n_lyr; i++) {
+    zero[i]["W1"] = MatrixXd::Zero(WgtBias[i].at("W1").rows(), WgtBias[i].at("W1").cols());
+    zero[i]["b1"] = MatrixXd::Zero(WgtBias[i].at("b1").rows(), WgtBias[i].at("b1").cols());
   }
-  // TODO TODO
-  auto top_grad = smx_grad(smx_prob(smx_W));
-  vector<vector<double> > prob = smx_prob(smx_W);
-  vector<double> I(prob.size(), 0);
-  for (auto p : n_class) {
-    I[p] = i;
+  zero[n_lyr]["W"] = MatrixXd::Zero(smx_W.rows(), smx_W.cols());
+  return zero;
+}
+
+
+void fine_tune::fn_apply_step(vector<unordered_map<string, MatrixXd> > & grad,
+                              vector<unordered_map<string, MatrixXd> > & delta){
+  for (int i = 0; i <= n_lyr; i++) {
+    for (auto & kv : grad[i]) {
+      kv.second *= -alpha;
+      MatrixXd & w = (i == n_lyr) ? smx_W : WgtBias[i].at(kv.first);
+      w += kv.second;
+      delta[i].at(kv.first) += kv.second;
+    }
   }
+  n_cached = std::min(n_cached, n_frozen);
+}
+
 
-  sigma[n_lyr] = smx_W * (I - P);
-  for (i = 0; i < n_lyr; i++) {
-    
+// frozen layers are identical on every worker and never exchanged
+void fine_tune::_fn_paracel_write(){
+  for (int i = n_frozen; i < n_lyr; i++) {
+    _paracel_write_shard("fn_W1_" + std::to_string(i), WgtBias[i].at("W1"));
+    _paracel_write_shard("fn_b1_" + std::to_string(i), WgtBias[i].at("b1"));
   }
-  sigma[n_lyr] = -(a[1])
+  _paracel_write_shard("smx_W", smx_W);
+}
 
+void fine_tune::_fn_paracel_read(){
+  for (int i = n_frozen; i < n_lyr; i++) {
+    _paracel_read_shard("fn_W1_" + std::to_string(i), WgtBias[i].at("W1"));
+    _paracel_read_shard("fn_b1_" + std::to_string(i), WgtBias[i].at("b1"));
+  }
+  _paracel_read_shard("smx_W", smx_W);
+  n_cached = std::min(n_cached, n_frozen);
 }
 
+void fine_tune::_fn_paracel_bupdate(const vector<unordered_map<string, MatrixXd> > & delta){
+  for (int i = n_frozen; i < n_lyr; i++) {
+    _paracel_bupdate_shard("fn_W1_" + std::to_string(i), delta[i].at("W1"));
+    _paracel_bupdate_shard("fn_b1_" + std::to_string(i), delta[i].at("b1"));
+  }
+  _paracel_bupdate_shard("smx_W", delta[n_lyr].at("W"));
+}
 
 
-vector<unordered_map<string, MatrixXd> > fine_tune::fn_mibt_stoc_grad() const{
-  vector<unordered_map<string, MatrixXd> > WgtBiasGrad;
-  int n_lyr = WgtBias.size();
-  for (int i = 0; i < n_lyr; i++) {
-    // initialize
-    unordered_map<string, MatrixXd> grad_elem;
-    grad_elem["W1"] = MatrixXd::Random(WgtBias[i].at("W1").rows(), WgtBias[i].at("W1").cols());
-    grad_elem["b1"] = MatrixXd::Random(WgtBias[i].at("b1").rows(), WgtBias[i].at("b1").cols());
-    WgtBiasGrad.push_back(grad_elem);
-  }
-  for (auto l : n_lyr) {
-    for (auto i: index_data) {
-      
+// distributed bgd over the whole stack
+void fine_tune::fn_distribute_bgd(){
+  std::cout << "worker" << get_worker_id() << ", fine-tuning cost: " << fn_cost() << std::endl;
+  _fn_paracel_write();
+  paracel_register_bupdate(update_lib, "ae_update");
+  vector<int> idx;
+  for (int i = 0; i < data.cols(); i++) {
+    idx.push_back(i);
+  }
+  vector<unordered_map<string, MatrixXd> > delta = fn_zero_like();
+  for (int rd = 0; rd < rounds; rd++) {
+    _fn_paracel_read();
+    for (auto & d : delta) { zero_delta(d); }
+    vector<unordered_map<string, MatrixXd> > grad = fn_mibt_stoc_grad(idx);
+    fn_apply_step(grad, delta);
+    // push
+    _fn_paracel_bupdate(delta);
+    iter_commit();
+    _fn_paracel_read();
+    std::cout << "worker" << get_worker_id() << ", fine-tuning cost: " << fn_cost() << std::endl;
+  } // rounds
+  // last pull
+  _fn_paracel_read();
+}
+
+
+void fine_tune::fn_downpour_sgd(){
+  fn_downpour(1);
+}
+
+
+void fine_tune::fn_downpour_sgd_mibt(){
+  fn_downpour(mibt_size);
+}
+
+
+// downpour sgd over the whole stack, a running delta pushed every
+// update_batch mini-batches as in the pretraining trainers
+void fine_tune::fn_downpour(int batch_size){
+  std::cout << "worker" << get_worker_id() << ", fine-tuning cost: " << fn_cost() << std::endl;
+  int mibt_cnt = 0;
+  if (read_batch == 0) { read_batch = 4; }
+  if (update_batch == 0) { update_batch = 4; }
+  _fn_paracel_write();
+  vector<int> idx;
+  for (int i = 0; i < data.cols(); i++) {
+    idx.push_back(i);
+  }
+  paracel_register_bupdate(update_lib, "ae_update");
+  vector<unordered_map<string, MatrixXd> > delta = fn_zero_like();
+
+  for (int rd = 0; rd < rounds; rd++) {
+    std::random_shuffle(idx.begin(), idx.end());
+    vector<vector<int> > mibt_idx; // mini-batch id
+    for (size_t st = 0; st < idx.size(); st += batch_size) {
+      mibt_idx.push_back(vector<int>(idx.begin() + st,
+                                     idx.begin() + std::min(idx.size(), st + batch_size)));
+    }
+
+    // traverse data
+    mibt_cnt = 0;
+    for (auto & mibt_sample_id : mibt_idx) {
+      if ( (mibt_cnt % read_batch == 0) || (mibt_cnt == (int)mibt_idx.size()-1) ) {
+        _fn_paracel_read();
+        for (auto & d : delta) { zero_delta(d); }
+      }
+      vector<unordered_map<string, MatrixXd> > grad = fn_mibt_stoc_grad(mibt_sample_id);
+      fn_apply_step(grad, delta);
+      if ( (mibt_cnt % update_batch == 0) || (mibt_cnt == (int)mibt_idx.size()-1) ) {
+        // push
+        _fn_paracel_bupdate(delta);
+        for (auto & d : delta) { zero_delta(d); }
+        iter_commit();
+      }
+      mibt_cnt += 1;
+    }  // traverse
+    sync();
+    std::cout << "worker" << get_worker_id() << ", fine-tuning cost: " << fn_cost() << std::endl;
+    std::cout << "worker" << get_worker_id() << "at the end of rd" << rd << std::endl;
+  }  // rounds
+  // last pull
+  _fn_paracel_read();
+}
+
+
+void fine_tune::fn_train(){
+  fn_load();
+  fn_cost();  // fills the activation cache and initializes the softmax
+  if (!grad_check.empty()) {
+    smx_nume_grad(grad_check);
+  } else if (debug) {
+    smx_nume_grad();
+  }
+  if (learning_method == "dbgd") {
+    std::cout << "worker" << get_worker_id() << " fine-tunes by distributed batch gradient descent" << std::endl;
+    set_total_iters(rounds);
+    fn_distribute_bgd();
+  } else if (learning_method == "dsgd") {
+    std::cout << "worker" << get_worker_id() << " fine-tunes by downpour stochasitc gradient descent" << std::endl;
+    set_total_iters(rounds * ceil(data.cols() / float(update_batch)));
+    fn_downpour_sgd();
+  } else {
+    if (learning_method != "mbdsgd") {
+      std::cout << "worker" << get_worker_id() << " has no fine-tuning by " << learning_method << ", falls back to mbdsgd" << std::endl;
     }
+    std::cout << "worker" << get_worker_id() << " fine-tunes by mini-batch downpour stochastic gradient descent" << std::endl;
+    int n_mibt = ceil(data.cols() / float(mibt_size));
+    set_total_iters(rounds * ceil(n_mibt / float(update_batch)));
+    fn_downpour_sgd_mibt();
   }
-  return WgtBiasGrad;
+  if (get_worker_id() == 0) {
+    fn_dump_result();
+  }
+  sync();
+  std::cout << "Fine-tuning complete" << std::endl;
+}
+
+
+void fine_tune::fn_dump_result() const {
+  for (int i = 0; i < n_lyr; i++) {
+    dump_mat(WgtBias[i].at("W1"), (todir(output) + "ae_layer_" + std::to_string(i) + "_W1"));
+    dump_mat(WgtBias[i].at("b1"), (todir(output) + "ae_layer_" + std::to_string(i) + "_b1"));
+  }
+  dump_mat(smx_W, (todir(output) + "smx_W"));
 }
 
 
@@ -21,32 +21,55 @@ namespace paracel{
 class fine_tune: public autoencoder {
 
  public:
-   fine_tune(paracel::Comm, string, string, string, vector<int>, int, vector<unordered_map<string, MatrixXd> >, string = "sgd", string = "sigmoid", int = 1, double = 0.01, bool = false, int = 0, bool = false, double = 0.001, double = 0.0001, double = 3., int = 1, int = 0, int = 0, int = 2); // TO BE COMPLETED
+   // fine-tunes the pretrained stack WgtBias with a softmax of n_class outputs on top
+   fine_tune(paracel::Comm, string, const ae_options &, const vector<unordered_map<string, MatrixXd> > &,
+             int = 14, int = 0, string = "");
    virtual ~fine_tune();
 
    // softmax
    void smx_init();
-   MatrixXd smx_prob(MatrixXd &) const; // probabilities of softmax classifier
-   double smx_cost(MatrixXd &) const;
-   MatrixXd smx_grad(MatrixXd &) const;
-   void smx_nume_grad();
+   MatrixXd smx_prob(const MatrixXd &, const MatrixXd &) const; // probabilities of softmax classifier
+   double smx_cost(const MatrixXd &) const;  // over the top activations
+   MatrixXd smx_grad(const MatrixXd &) const;  // over the top activations
+   void smx_nume_grad(string = "directional", int = 10);
 
    // fine tuning the whole networks
-   double fn_cost() const;
+   void fn_load();
+   void fn_propagate();  // refresh the activation cache
+   double fn_cost();
    vector<unordered_map<string, MatrixXd> > fn_stoc_grad(int) const;
-   vector<unordered_map<string, MatrixXd> > fn_mibt_stoc_grad() const;
+   vector<unordered_map<string, MatrixXd> > fn_mibt_stoc_grad(const vector<int> &) const;
    void fn_downpour_sgd(); // downpour stochastic gradient descent
    void fn_distribute_bgd(); // conventional batch-gradient descent
    void fn_downpour_sgd_mibt(); // downpour stochastic gradient descent and mini-batch involved
+   void fn_train(); // top function
+   void fn_dump_result() const;
+
+ private:
+   void fn_downpour(int);  // downpour over mini-batches of the given size
+   MatrixXd gather_cols(const MatrixXd &, const vector<int> &) const;
+   const MatrixXd & data_top() const { return acti_cache.back(); }
+   double smx_cost_logit(MatrixXd &, double) const;
+   vector<unordered_map<string, MatrixXd> > fn_zero_like() const;
+   void fn_apply_step(vector<unordered_map<string, MatrixXd> > &, vector<unordered_map<string, MatrixXd> > &);
+   // compatinility of paracel and the whole stack plus softmax
+   void _fn_paracel_write();
+   void _fn_paracel_read();
+   void _fn_paracel_bupdate(const vector<unordered_map<string, MatrixXd> > &);
 
  private:
    //vector<unordered_map<string, MatrixXd> > WgtBias;
    string input;
    string output;
    MatrixXd smx_W;
-   MatrixXd data_top;
-   VectorXd data_lbl;
-   int n_class;  // TODO
+   vector<int> data_lbl;  // labels mapped into [0, n_class)
+   int n_class;
+   int n_frozen;  // lower layers kept fixed during fine-tuning
+   string grad_check;  // "", "full", "sampled" or "directional"
+   // acti_cache[l] holds the activations of layer l over data; the first
+   // n_cached entries are up to date. Frozen layers never go stale.
+   vector<MatrixXd> acti_cache;
+   int n_cached = 0;
 
 };
 
@@ -0,0 +1,63 @@
+// Weight-gradient accumulation: per-sample rank-1 updates against the
+// buffered rank-k updates of outer_acc.
+//   grad_acc_bench [rows = 200] [cols = 513] [samples = 4096]
+// Accumulator traffic counts one read and one write of G per update.
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <eigen3/Eigen/Dense>
+#include "ae_kernel.hpp"
+
+using Eigen::MatrixXd;
+
+static double seconds_since(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char *argv[])
+{
+  int rows = argc > 1 ? std::atoi(argv[1]) : 200;
+  int cols = argc > 2 ? std::atoi(argv[2]) : 513;
+  int n = argc > 3 ? std::atoi(argv[3]) : 4096;
+  MatrixXd S = MatrixXd::Random(rows, n);
+  MatrixXd X = MatrixXd::Random(cols, n);
+  double flop = 2. * rows * cols * n;
+  double g_bytes = 2. * 8 * rows * cols;
+
+  // best of three runs, the first one also warms the pages up
+  MatrixXd G1;
+  double t1 = 1e30;
+  for (int r = 0; r < 3; r++) {
+    G1 = MatrixXd::Zero(rows, cols);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      G1.noalias() += S.col(i) * X.col(i).transpose();
+    }
+    t1 = std::min(t1, seconds_since(t0));
+  }
+  std::cout << std::setw(8) << "k" << std::setw(12) << "ms" << std::setw(12) << "GFLOP/s"
+            << std::setw(16) << "G traffic MB" << std::setw(12) << "max diff" << std::endl;
+  std::cout << std::setw(8) << "rank-1" << std::setw(12) << t1 * 1e3 << std::setw(12) << flop / t1 * 1e-9
+            << std::setw(16) << g_bytes * n / 1e6 << std::setw(12) << 0 << std::endl;
+
+  for (int k : {4, 8, 16, 32, 64, 128}) {
+    MatrixXd G;
+    double tk = 1e30;
+    for (int r = 0; r < 3; r++) {
+      G = MatrixXd::Zero(rows, cols);
+      auto t = std::chrono::steady_clock::now();
+      paracel::outer_acc acc(G, k);
+      for (int i = 0; i < n; i++) {
+        acc.add(S.col(i), X.col(i));
+      }
+      acc.flush();
+      tk = std::min(tk, seconds_since(t));
+    }
+    std::cout << std::setw(8) << k << std::setw(12) << tk * 1e3 << std::setw(12) << flop / tk * 1e-9
+              << std::setw(16) << g_bytes * ((n + k - 1) / k) / 1e6
+              << std::setw(12) << (G - G1).cwiseAbs().maxCoeff() << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,288 @@
+// Native replacement of songs/main_patch.py + songs/spec.py: decoded PCM
+// (WAV) -> power spectrum -> 64-frame mean patches -> log(x+1) ->
+// normalization, streamed out in the trainer's text format (513 values per
+// line followed by the label). Songs are processed in parallel, one output
+// file per thread.
+#include <string>
+#include <vector>
+#include <complex>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <google/gflags.h>
+#include <eigen3/Eigen/Dense>
+#include <eigen3/unsupported/Eigen/FFT>
+
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+
+DEFINE_string(song_list, "", "text file with one song per line: \"label path\", or \"path\" for unlabeled data.\n");
+
+DEFINE_string(output, "", "output directory, one part_<thread> file per thread.\n");
+
+DEFINE_int32(n_threads, 0, "threads, 0 means one per core.\n");
+
+DEFINE_int32(n_patches, 30, "patches randomly kept per song like main_patch.py, 0 keeps every patch in order.\n");
+
+DEFINE_int32(seed, 0, "seed of the patch selection, song k uses seed + k.\n");
+
+// same as the yaafe plan in spec.py
+const int SAMPLE_RATE = 22050;
+const int BLOCK = 1024;
+const int STEP = 512;
+const int DIM = BLOCK / 2 + 1;
+const int WIN = 64;  // frames per patch
+const int HOP = WIN / 2;
+
+
+// decode a RIFF/WAVE file into mono samples in [-1, 1]. Integer PCM of
+// 8/16/24/32 bits and 32/64-bit float are supported, channels are averaged
+bool read_wav(const std::string & path, std::vector<double> & pcm, int & rate) {
+  std::ifstream is(path, std::ios::binary);
+  char id[4];
+  uint32_t sz;
+  auto rd_u32 = [&](uint32_t & v) { is.read(reinterpret_cast<char *>(&v), 4); };
+  is.read(id, 4);
+  rd_u32(sz);
+  if (!is || std::strncmp(id, "RIFF", 4)) return false;
+  is.read(id, 4);
+  if (!is || std::strncmp(id, "WAVE", 4)) return false;
+
+  uint16_t fmt = 0, channels = 0, bits = 0;
+  uint32_t sample_rate = 0;
+  bool got_fmt = false;
+  while (is.read(id, 4)) {
+    rd_u32(sz);
+    if (!std::strncmp(id, "fmt ", 4)) {
+      std::vector<char> f(sz);
+      is.read(f.data(), sz);
+      std::memcpy(&fmt, &f[0], 2);
+      std::memcpy(&channels, &f[2], 2);
+      std::memcpy(&sample_rate, &f[4], 4);
+      std::memcpy(&bits, &f[14], 2);
+      if (fmt == 0xFFFE && sz >= 26) {  // WAVE_FORMAT_EXTENSIBLE, subformat GUID
+        std::memcpy(&fmt, &f[24], 2);
+      }
+      got_fmt = true;
+    } else if (!std::strncmp(id, "data", 4)) {
+      if (!got_fmt || channels == 0) return false;
+      std::vector<unsigned char> raw(sz);
+      is.read(reinterpret_cast<char *>(raw.data()), sz);
+      int bps = bits / 8;
+      size_t n = is.gcount() / (bps * channels);
+      pcm.assign(n, 0.);
+      const unsigned char * p = raw.data();
+      for (size_t i = 0; i < n; i++) {
+        double acc = 0.;
+        for (int c = 0; c < channels; c++, p += bps) {
+          if (fmt == 3 && bits == 32) {
+            float v;
+            std::memcpy(&v, p, 4);
+            acc += v;
+          } else if (fmt == 3 && bits == 64) {
+            double v;
+            std::memcpy(&v, p, 8);
+            acc += v;
+          } else if (fmt == 1 && bits == 8) {
+            acc += (p[0] - 128) / 128.;
+          } else if (fmt == 1 && bits == 16) {
+            acc += int16_t(p[0] | (p[1] << 8)) / 32768.;
+          } else if (fmt == 1 && bits == 24) {
+            int32_t v = (p[0] << 8) | (p[1] << 16) | (p[2] << 24);
+            acc += (v >> 8) / 8388608.;
+          } else if (fmt == 1 && bits == 32) {
+            int32_t v;
+            std::memcpy(&v, p, 4);
+            acc += v / 2147483648.;
+          } else {
+            return false;
+          }
+        }
+        pcm[i] = acc / channels;
+      }
+      rate = sample_rate;
+      return true;
+    } else {
+      is.seekg(sz + (sz & 1), std::ios::cur);
+    }
+  }
+  return false;
+}
+
+// linear interpolation to SAMPLE_RATE; yaafe resamples in spec.py too
+void resample(std::vector<double> & pcm, int rate) {
+  if (rate == SAMPLE_RATE || pcm.empty()) return;
+  double r = double(rate) / SAMPLE_RATE;
+  size_t n = size_t((pcm.size() - 1) / r) + 1;
+  std::vector<double> out(n);
+  for (size_t i = 0; i < n; i++) {
+    double x = i * r;
+    size_t k = std::min(size_t(x), pcm.size() - 1);
+    double t = x - k;
+    out[i] = k + 1 < pcm.size() ? (1 - t) * pcm[k] + t * pcm[k+1] : pcm[k];
+  }
+  pcm.swap(out);
+}
+
+
+// per thread spectrum state: FFT plan, Hann window and scratch buffers
+class spectrum {
+ public:
+  spectrum() : win(BLOCK), frame(BLOCK) {
+    for (int i = 0; i < BLOCK; i++) {
+      win[i] = 0.5 - 0.5 * std::cos(2 * M_PI * i / (BLOCK - 1));
+    }
+    fft.SetFlag(Eigen::FFT<double>::HalfSpectrum);
+  }
+
+  // number of frames of a signal of n samples; the tail frame is zero padded
+  static int n_frames(size_t n) { return n == 0 ? 0 : int((n - 1) / STEP) + 1; }
+
+  // acc += |FFT(hann * frame f)|^2
+  void add_power(const std::vector<double> & pcm, int f, double * acc) {
+    size_t st = size_t(f) * STEP;
+    for (int i = 0; i < BLOCK; i++) {
+      frame[i] = st + i < pcm.size() ? pcm[st + i] * win[i] : 0.;
+    }
+    fft.fwd(bins, frame);
+    for (int k = 0; k < DIM; k++) {
+      acc[k] += std::norm(bins[k]);
+    }
+  }
+
+ private:
+  Eigen::FFT<double> fft;
+  std::vector<double> win;
+  std::vector<double> frame;
+  std::vector<std::complex<double> > bins;
+};
+
+
+// patches of one song as columns, normalized like main_patch.py
+bool song_patches(const std::string & path, int n_patches, unsigned seed,
+                  spectrum & spec, MatrixXd & patches) {
+  std::vector<double> pcm;
+  int rate;
+  if (!read_wav(path, pcm, rate)) {
+    std::cerr << "can not decode " << path << std::endl;
+    return false;
+  }
+  resample(pcm, rate);
+  int n_frm = spectrum::n_frames(pcm.size());
+  if (n_frm < WIN) {
+    std::cerr << path << " is shorter than a patch" << std::endl;
+    return false;
+  }
+  int n_win = (n_frm - WIN) / HOP + 1;
+  std::vector<int> wid(n_win);
+  for (int i = 0; i < n_win; i++) wid[i] = i;
+  if (n_patches > 0) {
+    if (n_win < n_patches) {
+      std::cerr << path << " has " << n_win << " patches only" << std::endl;
+      return false;
+    }
+    std::shuffle(wid.begin(), wid.end(), std::mt19937(seed));
+    wid.resize(n_patches);
+  }
+
+  // a window is the sum of two half windows of HOP frames; only the halves
+  // under a selected window go through the FFT
+  std::vector<int> half_of(n_win + 1, -1);
+  int n_half = 0;
+  for (int w : wid) {
+    if (half_of[w] < 0) half_of[w] = n_half++;
+    if (half_of[w+1] < 0) half_of[w+1] = n_half++;
+  }
+  MatrixXd half = MatrixXd::Zero(DIM, n_half);
+  for (int h = 0; h <= n_win; h++) {
+    if (half_of[h] < 0) continue;
+    for (int f = h * HOP; f < (h + 1) * HOP; f++) {
+      spec.add_power(pcm, f, half.col(half_of[h]).data());
+    }
+  }
+  patches.resize(DIM, wid.size());
+  for (size_t k = 0; k < wid.size(); k++) {
+    patches.col(k) = (half.col(half_of[wid[k]]) + half.col(half_of[wid[k]+1])) / WIN;
+  }
+
+  // log(x + 1), remove the mean of every patch, clip at 3 std of the whole
+  // song and rescale from [-1, 1] to [0.1, 0.9]
+  patches = patches.array().log1p().matrix();
+  patches.rowwise() -= patches.colwise().mean();
+  double dstd = 3 * std::sqrt(patches.squaredNorm() / patches.size());
+  if (dstd == 0) {
+    std::cerr << path << " is silent" << std::endl;
+    return false;
+  }
+  patches = (patches.array().min(dstd).max(-dstd) / dstd + 1) * 0.4 + 0.1;
+  return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+  google::SetUsageMessage("[options]\n\t--song_list\n\t--output\n\t--n_threads\n\t--n_patches\n\t--seed\n");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  // label (may be empty) and path of every song
+  std::vector<std::pair<std::string, std::string> > songs;
+  std::ifstream ls(FLAGS_song_list);
+  std::string line;
+  while (std::getline(ls, line)) {
+    if (line.empty()) continue;
+    size_t sp = line.find(' ');
+    if (sp == std::string::npos) {
+      songs.push_back(std::make_pair(std::string(), line));
+    } else {
+      songs.push_back(std::make_pair(line.substr(0, sp), line.substr(sp + 1)));
+    }
+  }
+  int n_threads = FLAGS_n_threads > 0 ? FLAGS_n_threads : std::max(1u, std::thread::hardware_concurrency());
+
+  std::atomic<size_t> next(0), n_done(0), n_lines(0);
+  auto worker = [&](int tid) {
+    std::ofstream os(FLAGS_output + "/part_" + std::to_string(tid));
+    spectrum spec;
+    MatrixXd patches;
+    std::string buf;
+    char num[32];
+    for (size_t s = next++; s < songs.size(); s = next++) {
+      if (!song_patches(songs[s].second, FLAGS_n_patches, FLAGS_seed + s, spec, patches)) {
+        continue;
+      }
+      buf.clear();
+      for (int k = 0; k < patches.cols(); k++) {
+        for (int d = 0; d < DIM; d++) {
+          int len = std::snprintf(num, sizeof(num), d ? " %.6g" : "%.6g", patches(d, k));
+          buf.append(num, len);
+        }
+        if (!songs[s].first.empty()) {
+          buf += ' ';
+          buf += songs[s].first;
+        }
+        buf += '\n';
+      }
+      os.write(buf.data(), buf.size());
+      n_done++;
+      n_lines += patches.cols();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; t++) {
+    threads.push_back(std::thread(worker, t));
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  std::cout << n_done << " of " << songs.size() << " songs, " << n_lines
+            << " patches written to " << FLAGS_output << std::endl;
+  return 0;
+}